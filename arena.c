@@ -0,0 +1,84 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#include "arena.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Memory is handed out from a chain of large blocks. */
+#define BLOCK_SIZE (64 * 1024)
+
+#define ALIGNMENT _Alignof(max_align_t)
+
+typedef struct block {
+    struct block *next;
+    size_t used;
+    size_t size;
+    _Alignas(max_align_t) char data[];
+} block_t;
+
+struct arena {
+    block_t *blocks;    /* most recently allocated first */
+};
+
+arena_t *arena(void) {
+    return calloc(1, sizeof(arena_t));
+}
+
+void arena_destroy(arena_t *a) {
+    while (a->blocks != NULL) {
+        block_t *b = a->blocks;
+        a->blocks = b->next;
+        free(b);
+    }
+    free(a);
+}
+
+/* Reserve len bytes at the given alignment. Blocks are calloced and never
+ * reused, so the memory is zeroed.
+ */
+static void *reserve(arena_t *a, size_t len, size_t align) {
+    block_t *b = a->blocks;
+    size_t offset = b == NULL ? 0 : (b->used + align - 1) & ~(align - 1);
+    if (b == NULL || offset > b->size || b->size - offset < len) {
+        size_t size = len > BLOCK_SIZE ? len : BLOCK_SIZE;
+        b = calloc(1, sizeof(*b) + size);
+        if (b == NULL)
+            return NULL;
+        b->size = size;
+        /* An oversized allocation gets a block to itself, behind the current
+         * one, so the remainder of the current block is not wasted.
+         */
+        if (len > BLOCK_SIZE && a->blocks != NULL) {
+            b->next = a->blocks->next;
+            a->blocks->next = b;
+        } else {
+            b->next = a->blocks;
+            a->blocks = b;
+        }
+        offset = 0;
+    }
+
+    void *p = &b->data[offset];
+    b->used = offset + len;
+    return p;
+}
+
+void *arena_alloc(arena_t *a, size_t size) {
+    return reserve(a, size == 0 ? 1 : size, ALIGNMENT);
+}
+
+void *arena_copy(arena_t *a, const void *data, size_t len) {
+    void *p = reserve(a, len == 0 ? 1 : len, 1);
+    if (p != NULL)
+        memcpy(p, data, len);
+    return p;
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+/* A bump allocator for many small objects with a common lifetime. Memory is
+ * carved out of large blocks and never freed individually; destroying the
+ * arena releases all of it at once. An arena is not safe to share between
+ * threads without external locking.
+ */
+
+#include <stddef.h>
+
+typedef struct arena arena_t;
+
+/* Returns NULL on failure. */
+arena_t *arena(void);
+void arena_destroy(arena_t *a);
+
+/* Allocate zeroed memory, aligned for any type. Returns NULL on failure. */
+void *arena_alloc(arena_t *a, size_t size);
+
+/* Copy some bytes into the arena, without aligning them (e.g. for strings).
+ * Returns the copy, or NULL on failure.
+ */
+void *arena_copy(arena_t *a, const void *data, size_t len);
+
+#endif
@@ -0,0 +1,241 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+/* Generator for synthetic translation units to benchmark prune against. The
+ * output is self-contained C (no #includes) resembling preprocessed kernel
+ * source: a block of typedef'd structs, prototypes for every function and then
+ * the function definitions themselves.
+ *
+ * Functions are arranged in layers, with fn_0 alone in the first layer. Each
+ * function calls --fanout functions chosen from deeper layers, so the longest
+ * call chain from fn_0 is --depth. A --recursion percentage of functions also
+ * call back into a shallower layer, creating cycles.
+ */
+
+#include <getopt.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+    unsigned long functions;
+    unsigned long fanout;
+    unsigned long depth;
+    unsigned recursion;     /* percentage of functions with a back edge */
+    unsigned types;         /* structs per 100 functions */
+    unsigned attributes;    /* percentage of functions with attributes */
+    unsigned long seed;
+} params_t;
+
+/* xorshift64, so output for a given seed is the same on every platform. */
+static uint64_t state;
+
+static uint64_t rnd(void) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static unsigned long below(unsigned long n) {
+    return n == 0 ? 0 : (unsigned long)(rnd() % n);
+}
+
+static bool chance(unsigned percent) {
+    return below(100) < percent;
+}
+
+/* The first function in a given layer. Layer 0 holds only fn_0 and the
+ * remaining functions are split evenly over the other layers.
+ */
+static unsigned long layer_start(const params_t *p, unsigned long layer) {
+    if (layer == 0)
+        return 0;
+    if (layer > p->depth)
+        return p->functions;
+    return 1 + (p->functions - 1) * (layer - 1) / p->depth;
+}
+
+static const char *const ATTRIBUTES[] = {
+    "__attribute__((noinline))",
+    "__attribute__((pure))",
+    "__attribute__((unused))",
+    "__attribute__((cold))",
+};
+
+static void generate(const params_t *p, FILE *f) {
+    unsigned long types = p->functions * p->types / 100;
+
+    fprintf(f, "/* prune benchmark: %lu functions, fanout %lu, depth %lu, "
+        "recursion %u%%, types %u%%, attributes %u%%, seed %lu */\n\n",
+        p->functions, p->fanout, p->depth, p->recursion, p->types,
+        p->attributes, p->seed);
+
+    fprintf(f, "typedef unsigned long word_t;\n\n");
+
+    for (unsigned long i = 0; i < types; i++) {
+        fprintf(f, "typedef struct s%lu {\n", i);
+        fprintf(f, "    word_t w%lu;\n", i);
+        if (i > 0)
+            fprintf(f, "    struct s%lu *link;\n", below(i));
+        fprintf(f, "} t%lu;\n\n", i);
+    }
+
+    /* Prototypes, so calls to later functions are well-formed. */
+    for (unsigned long i = 0; i < p->functions; i++)
+        fprintf(f, "word_t fn_%lu(word_t x);\n", i);
+    fprintf(f, "\n");
+
+    unsigned long layer = 0;
+    for (unsigned long i = 0; i < p->functions; i++) {
+        while (layer < p->depth && layer_start(p, layer + 1) <= i)
+            layer++;
+
+        if (chance(p->attributes))
+            fprintf(f, "%s ",
+                ATTRIBUTES[below(sizeof(ATTRIBUTES) / sizeof(ATTRIBUTES[0]))]);
+        fprintf(f, "word_t fn_%lu(word_t x) {\n", i);
+
+        if (types > 0) {
+            unsigned long t = below(types);
+            fprintf(f, "    t%lu v = { .w%lu = x };\n", t, t);
+            fprintf(f, "    x += v.w%lu;\n", t);
+        }
+
+        unsigned long lo = layer_start(p, layer + 1);
+        unsigned long hi = layer_start(p, layer + 2);
+        if (lo < hi) {
+            for (unsigned long j = 0; j < p->fanout; j++)
+                fprintf(f, "    x = fn_%lu(x ^ %luUL);\n", lo + below(hi - lo),
+                    j);
+        }
+
+        if (layer > 0 && chance(p->recursion)) {
+            unsigned long target = below(layer_start(p, layer));
+            fprintf(f, "    if (x & 1)\n        x = fn_%lu(x >> 1);\n", target);
+        }
+
+        fprintf(f, "    return x + %luUL;\n}\n\n", i);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s options...\n"
+                    " Options:\n"
+                    "  --functions n | -n n     Number of functions (default 1000)\n"
+                    "  --fanout n | -f n        Calls made by each function (default 4)\n"
+                    "  --depth n | -d n         Length of the longest call chain from\n"
+                    "                           fn_0 (default 16)\n"
+                    "  --recursion n | -r n     Percentage of functions that call back\n"
+                    "                           into a shallower layer (default 5)\n"
+                    "  --types n | -t n         Typedef'd structs per 100 functions\n"
+                    "                           (default 20)\n"
+                    "  --attributes n | -a n    Percentage of functions carrying an\n"
+                    "                           __attribute__ (default 10)\n"
+                    "  --seed n | -s n          Random seed (default 1)\n"
+                    "  --help | -?              Print this information\n",
+        prog);
+}
+
+static int parse_number(const char *s, unsigned long max, unsigned long *out) {
+    char *end;
+    unsigned long v = strtoul(s, &end, 10);
+    if (*s == '\0' || *end != '\0' || v > max)
+        return -1;
+    *out = v;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    params_t p = {
+        .functions = 1000,
+        .fanout = 4,
+        .depth = 16,
+        .recursion = 5,
+        .types = 20,
+        .attributes = 10,
+        .seed = 1,
+    };
+
+    struct option opts[] = {
+        {"attributes", required_argument, NULL, 'a'},
+        {"depth", required_argument, NULL, 'd'},
+        {"fanout", required_argument, NULL, 'f'},
+        {"functions", required_argument, NULL, 'n'},
+        {"help", no_argument, NULL, '?'},
+        {"recursion", required_argument, NULL, 'r'},
+        {"seed", required_argument, NULL, 's'},
+        {"types", required_argument, NULL, 't'},
+        {NULL, 0, NULL, 0},
+    };
+
+    while (true) {
+        int index = 0;
+        int c = getopt_long(argc, argv, "a:d:f:n:r:s:t:?", opts, &index);
+
+        if (c == -1)
+            break;
+
+        unsigned long v;
+        if (c != '?' && parse_number(optarg, c == 'a' || c == 'r' ? 100 :
+                UINT_MAX, &v) != 0) {
+            fprintf(stderr, "invalid argument to -%c: %s\n", c, optarg);
+            return -1;
+        }
+
+        switch (c) {
+            case 'a': /* --attributes */
+                p.attributes = (unsigned)v;
+                break;
+            case 'd': /* --depth */
+                p.depth = v;
+                break;
+            case 'f': /* --fanout */
+                p.fanout = v;
+                break;
+            case 'n': /* --functions */
+                p.functions = v;
+                break;
+            case 'r': /* --recursion */
+                p.recursion = (unsigned)v;
+                break;
+            case 's': /* --seed */
+                p.seed = v;
+                break;
+            case 't': /* --types */
+                p.types = (unsigned)v;
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (p.functions == 0) {
+        fprintf(stderr, "--functions must be non-zero\n");
+        return -1;
+    }
+    /* Every layer after the first needs at least one function. */
+    if (p.depth >= p.functions)
+        p.depth = p.functions - 1;
+
+    /* xorshift must never be seeded with zero. */
+    state = p.seed * 0x9e3779b97f4a7c15ULL + 1;
+
+    generate(&p, stdout);
+
+    if (fflush(stdout) != 0) {
+        perror("failed to write output");
+        return -1;
+    }
+    return 0;
+}
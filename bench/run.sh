@@ -0,0 +1,66 @@
+#!/bin/sh
+#
+# Copyright 2014, NICTA
+#
+# This software may be distributed and modified according to the terms of
+# the BSD 2-Clause license. Note that NO WARRANTY is provided.
+# See "LICENSE_BSD2.txt" for details.
+#
+# @TAG(NICTA_BSD)
+#
+
+# Benchmark harness. Generates a series of synthetic translation units with
+# bench/gen, prunes each of them from fn_0 and appends prune's --stats output
+# for every run to a results file as one JSON object per line, tagged with the
+# generator parameters that produced it.
+#
+# Usage: run.sh [prune [gen [results]]]
+#
+# Each input is pruned once per entry in BENCH_VARIANTS, a space-separated list
+# of prune flags where "-" means none, so the AST scanner (the default and
+# --lazy) can be compared with --token-scan and --skip-bodies. Extra arguments
+# for every run can be given in PRUNE_FLAGS. The set of configurations can be
+# replaced by setting BENCH_CONFIGS to a newline-separated list of gen
+# arguments.
+
+set -e
+
+PRUNE=${1:-./prune}
+GEN=${2:-./bench/gen}
+RESULTS=${3:-bench/results.json}
+
+: ${BENCH_CONFIGS:="-n 1000 -f 4 -d 16
+-n 10000 -f 4 -d 16
+-n 10000 -f 16 -d 64 -r 20
+-n 10000 -f 4 -d 1000 -r 50
+-n 50000 -f 8 -d 32 -t 100 -a 50
+-n 100000 -f 4 -d 256 -r 5"}
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/prune-bench.XXXXXX")
+trap 'rm -rf "${WORK}"' EXIT
+
+: ${BENCH_VARIANTS:="- -l -T -B"}
+
+REVISION=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+printf '%s\n' "${BENCH_CONFIGS}" | while read -r CONFIG; do
+    [ -z "${CONFIG}" ] && continue
+    ${GEN} ${CONFIG} > "${WORK}/input.c"
+    for VARIANT in ${BENCH_VARIANTS}; do
+        [ "${VARIANT}" = "-" ] && VARIANT=
+        FLAGS=$(echo ${VARIANT} ${PRUNE_FLAGS})
+        if ! ${PRUNE} ${FLAGS} --stats --keep fn_0 \
+                --output "${WORK}/output.c" "${WORK}/input.c" \
+                2> "${WORK}/stderr"; then
+            echo " [BENCH] ${CONFIG} ${FLAGS}: prune failed" >&2
+            cat "${WORK}/stderr" >&2
+            exit 1
+        fi
+        # The statistics are the last thing prune writes to stderr.
+        STATS=$(tail -n 1 "${WORK}/stderr")
+        printf '{"revision":"%s","config":"%s","flags":"%s","stats":%s}\n' \
+            "${REVISION}" "${CONFIG}" "${FLAGS}" "${STATS}" >> "${RESULTS}"
+        WALL=$(printf '%s' "${STATS}" | sed -n 's/.*"wall":\([0-9.]*\).*/\1/p')
+        echo " [BENCH] ${CONFIG} ${FLAGS}: ${WALL}s"
+    done
+done
@@ -0,0 +1,123 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#include "bitset.h"
+#include "set.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "symtab.h"
+
+#define WORD_BITS 64
+
+struct bitset {
+    uint64_t *words;
+    size_t words_sz;
+};
+
+bitset_t *bitset(void) {
+    return calloc(1, sizeof(bitset_t));
+}
+
+/* Make room for at least the given number of words. Returns non-zero on
+ * failure.
+ */
+static int reserve(bitset_t *b, size_t words_sz) {
+    if (words_sz <= b->words_sz)
+        return 0;
+
+    size_t sz = b->words_sz == 0 ? 64 : b->words_sz;
+    while (sz < words_sz)
+        sz *= 2;
+    uint64_t *words = realloc(b->words, sz * sizeof(*words));
+    if (words == NULL)
+        return -1;
+    memset(words + b->words_sz, 0, (sz - b->words_sz) * sizeof(*words));
+    b->words = words;
+    b->words_sz = sz;
+    return 0;
+}
+
+bitset_t *bitset_from_set(set_t *s) {
+    bitset_t *b = bitset();
+    if (b == NULL)
+        return NULL;
+    bool ok = true;
+    void add(sym_t item) {
+        if (bitset_insert(b, item) != 0)
+            ok = false;
+    }
+    set_foreach(s, add);
+    if (!ok) {
+        bitset_destroy(b);
+        return NULL;
+    }
+    return b;
+}
+
+bitset_t *bitset_copy(const bitset_t *b) {
+    bitset_t *copy = bitset();
+    if (copy == NULL)
+        return NULL;
+    if (reserve(copy, b->words_sz) != 0) {
+        bitset_destroy(copy);
+        return NULL;
+    }
+    if (b->words_sz > 0)
+        memcpy(copy->words, b->words, b->words_sz * sizeof(*b->words));
+    return copy;
+}
+
+void bitset_destroy(bitset_t *b) {
+    free(b->words);
+    free(b);
+}
+
+int bitset_insert(bitset_t *b, sym_t item) {
+    if (reserve(b, (size_t)item / WORD_BITS + 1) != 0)
+        return -1;
+    b->words[item / WORD_BITS] |= UINT64_C(1) << (item % WORD_BITS);
+    return 0;
+}
+
+void bitset_remove(bitset_t *b, sym_t item) {
+    size_t i = item / WORD_BITS;
+    if (i < b->words_sz)
+        b->words[i] &= ~(UINT64_C(1) << (item % WORD_BITS));
+}
+
+bool bitset_contains(const bitset_t *b, sym_t item) {
+    size_t i = item / WORD_BITS;
+    return i < b->words_sz &&
+        (b->words[i] >> (item % WORD_BITS) & 1) != 0;
+}
+
+unsigned int bitset_size(const bitset_t *b) {
+    unsigned int size = 0;
+    for (size_t i = 0; i < b->words_sz; i++)
+        size += __builtin_popcountll(b->words[i]);
+    return size;
+}
+
+int bitset_union(bitset_t *a, const bitset_t *b) {
+    if (reserve(a, b->words_sz) != 0)
+        return -1;
+    for (size_t i = 0; i < b->words_sz; i++)
+        a->words[i] |= b->words[i];
+    return 0;
+}
+
+void bitset_foreach(const bitset_t *b, void (*f)(sym_t item)) {
+    for (size_t i = 0; i < b->words_sz; i++) {
+        for (uint64_t w = b->words[i]; w != 0; w &= w - 1)
+            f((sym_t)(i * WORD_BITS + __builtin_ctzll(w)));
+    }
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#ifndef _BITSET_H_
+#define _BITSET_H_
+
+/* Implementation of a set of symbols (see symtab.h) as a bitmap indexed by
+ * their identifiers. Identifiers are dense, so for sets holding a good fraction
+ * of a symbol table (e.g. every function reachable from those kept) this is far
+ * smaller than a set_t, and membership is a single bit test. The bitmap grows
+ * on demand, so symbols interned after it was created can still be inserted.
+ */
+
+#include "set.h"
+#include <stdbool.h>
+#include "symtab.h"
+
+typedef struct bitset bitset_t;
+
+/* Returns NULL on failure. */
+bitset_t *bitset(void);
+
+/* Create a bitset with the same members as a set. Returns NULL on failure. */
+bitset_t *bitset_from_set(set_t *s);
+
+bitset_t *bitset_copy(const bitset_t *b);
+void bitset_destroy(bitset_t *b);
+
+/* Returns non-zero on failure. */
+int bitset_insert(bitset_t *b, sym_t item);
+void bitset_remove(bitset_t *b, sym_t item);
+bool bitset_contains(const bitset_t *b, sym_t item);
+unsigned int bitset_size(const bitset_t *b);
+
+/* Add the members of b to a. Returns non-zero on failure. */
+int bitset_union(bitset_t *a, const bitset_t *b);
+
+/* Invoke a function on each member, in ascending order of identifier. The
+ * function must not insert into the bitset.
+ */
+void bitset_foreach(const bitset_t *b, void (*f)(sym_t item));
+
+#endif
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#include "buf.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+buf_t *buf(size_t capacity) {
+    buf_t *b = calloc(1, sizeof(*b));
+    if (b == NULL)
+        return NULL;
+    if (capacity > 0) {
+        b->data = malloc(capacity);
+        if (b->data == NULL) {
+            free(b);
+            return NULL;
+        }
+        b->capacity = capacity;
+    }
+    return b;
+}
+
+void buf_destroy(buf_t *b) {
+    free(b->data);
+    free(b);
+}
+
+/* Make room for at least len more bytes. */
+static int reserve(buf_t *b, size_t len) {
+    if (b->capacity - b->size >= len)
+        return 0;
+    size_t capacity = b->capacity == 0 ? 4096 : b->capacity;
+    while (capacity - b->size < len)
+        capacity *= 2;
+    char *data = realloc(b->data, capacity);
+    if (data == NULL)
+        return -1;
+    b->data = data;
+    b->capacity = capacity;
+    return 0;
+}
+
+int buf_append(buf_t *b, const char *data, size_t len) {
+    if (reserve(b, len) != 0)
+        return -1;
+    memcpy(&b->data[b->size], data, len);
+    b->size += len;
+    return 0;
+}
+
+int buf_puts(buf_t *b, const char *s) {
+    return buf_append(b, s, strlen(s));
+}
+
+int buf_putc(buf_t *b, char c) {
+    if (reserve(b, 1) != 0)
+        return -1;
+    b->data[b->size++] = c;
+    return 0;
+}
+
+void buf_reset(buf_t *b) {
+    b->size = 0;
+}
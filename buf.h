@@ -0,0 +1,38 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/* Implementation of a growable byte buffer, used for accumulating output in
+ * user space so it can be written in large chunks.
+ */
+
+#include <stddef.h>
+
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+} buf_t;
+
+/* Returns NULL on failure. */
+buf_t *buf(size_t capacity);
+void buf_destroy(buf_t *b);
+
+/* Append data to the buffer. Returns non-zero on failure. */
+int buf_append(buf_t *b, const char *data, size_t len);
+int buf_puts(buf_t *b, const char *s);
+int buf_putc(buf_t *b, char c);
+
+/* Discard the contents of the buffer. */
+void buf_reset(buf_t *b);
+
+#endif
@@ -0,0 +1,142 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#include "cache.h"
+#include "cfg.h"
+#include <clang-c/Index.h> /* -lclang */
+#include <errno.h>
+#include <glib.h>
+#include "source.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+char *cache_key(const char *input, const source_t *src,
+        const char *const *args, size_t args_sz, unsigned int flags) {
+    GChecksum *sum = g_checksum_new(G_CHECKSUM_SHA256);
+    if (sum == NULL)
+        return NULL;
+
+    /* Each field is NUL-terminated so that, e.g., the arguments "-x" "c"
+     * cannot collide with "-xc".
+     */
+    void update(const char *data, size_t len) {
+        g_checksum_update(sum, (const unsigned char*)data, len);
+    }
+    void update_str(const char *s) {
+        update(s, strlen(s) + 1);
+    }
+
+    CXString version = clang_getClangVersion();
+    update_str(clang_getCString(version));
+    clang_disposeString(version);
+
+    update_str(input);
+    for (size_t i = 0; i < args_sz; i++)
+        update_str(args[i]);
+    char options[32];
+    snprintf(options, sizeof(options), "%u", flags);
+    update_str(options);
+    if (src->size > 0)
+        update(src->data, src->size);
+
+    char *key = strdup(g_checksum_get_string(sum));
+    g_checksum_free(sum);
+    return key;
+}
+
+char *cache_path(const char *dir, const char *key, const char *suffix) {
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+        return NULL;
+
+    size_t len = strlen(dir) + strlen("/") + strlen(key) + strlen(suffix);
+    char *path = malloc(len + 1);
+    if (path == NULL)
+        return NULL;
+    sprintf(path, "%s/%s%s", dir, key, suffix);
+    return path;
+}
+
+CXTranslationUnit cache_load_tu(CXIndex index, const char *path) {
+    /* Avoid libclang complaining about entries that don't exist yet. */
+    if (access(path, R_OK) != 0)
+        return NULL;
+    return clang_createTranslationUnit(index, path);
+}
+
+/* Create a temporary file alongside a cache entry, so the entry can be written
+ * there and then moved into place. Returns the malloced path of the file, or
+ * NULL on failure. If fd is non-NULL, the file is left open.
+ */
+static char *temporary(const char *path, int *fd) {
+    size_t len = strlen(path) + strlen(".XXXXXX");
+    char *tmp = malloc(len + 1);
+    if (tmp == NULL)
+        return NULL;
+    sprintf(tmp, "%s.XXXXXX", path);
+    int f = mkstemp(tmp);
+    if (f < 0) {
+        free(tmp);
+        return NULL;
+    }
+    if (fd == NULL)
+        close(f);
+    else
+        *fd = f;
+    return tmp;
+}
+
+/* Move a completed temporary file into place, or discard it. */
+static int commit(char *tmp, const char *path, bool ok) {
+    int ret = -1;
+    if (ok && rename(tmp, path) == 0)
+        ret = 0;
+    if (ret != 0)
+        unlink(tmp);
+    free(tmp);
+    return ret;
+}
+
+int cache_save_tu(CXTranslationUnit tu, const char *path) {
+    char *tmp = temporary(path, NULL);
+    if (tmp == NULL)
+        return -1;
+    return commit(tmp, path,
+        clang_saveTranslationUnit(tu, tmp, clang_defaultSaveOptions(tu)) ==
+            CXSaveError_None);
+}
+
+int cache_load_cfg(cfg_t *c, const char *path, const char *key) {
+    source_t *src = source(path);
+    if (src == NULL)
+        return -1;
+    int ret = cfg_deserialise(c, src->data, src->size, key);
+    source_destroy(src);
+    return ret;
+}
+
+int cache_save_cfg(cfg_t *c, const char *path, const char *key) {
+    int fd;
+    char *tmp = temporary(path, &fd);
+    if (tmp == NULL)
+        return -1;
+    FILE *f = fdopen(fd, "w");
+    if (f == NULL) {
+        close(fd);
+        return commit(tmp, path, false);
+    }
+    bool ok = cfg_serialise(c, f, key) == 0;
+    ok &= fclose(f) == 0;
+    return commit(tmp, path, ok);
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+/* Caching of parsed translation units across runs. Cache entries are keyed on
+ * everything that affects the result of parsing: the input path, its
+ * contents, the arguments passed to Clang and the version of libclang itself.
+ */
+
+#include "cfg.h"
+#include <clang-c/Index.h> /* -lclang */
+#include "source.h"
+#include <stddef.h>
+
+/* Compute the key for an input file, with the given contents, parsed with the
+ * given arguments and clang_parseTranslationUnit flags. Returns a malloced
+ * string, or NULL on failure.
+ */
+char *cache_key(const char *input, const source_t *src,
+    const char *const *args, size_t args_sz, unsigned int flags);
+
+/* Construct the path of the entry for the given key within a cache directory,
+ * creating the directory if necessary. Returns a malloced string, or NULL on
+ * failure.
+ */
+char *cache_path(const char *dir, const char *key, const char *suffix);
+
+/* Load a previously saved translation unit. Returns NULL if there is no usable
+ * entry at the given path.
+ */
+CXTranslationUnit cache_load_tu(CXIndex index, const char *path);
+
+/* Save a translation unit to the given path. The entry is written atomically,
+ * so concurrent readers and writers never see a partial entry. Returns
+ * non-zero on failure.
+ */
+int cache_save_tu(CXTranslationUnit tu, const char *path);
+
+/* Fill in the call edges of a lazy CFG from the entry at the given path, if
+ * it exists and was saved with the same key. Returns non-zero otherwise, in
+ * which case the CFG should be discarded.
+ */
+int cache_load_cfg(cfg_t *c, const char *path, const char *key);
+
+/* Save the call edges of a CFG to the given path, tagged with the given key.
+ * As for cache_save_tu, the entry is written atomically. Returns non-zero on
+ * failure.
+ */
+int cache_save_cfg(cfg_t *c, const char *path, const char *key);
+
+#endif
@@ -8,85 +8,318 @@
  * @TAG(NICTA_BSD)
  */
 
+#include "arena.h"
 #include <assert.h>
+#include "bitset.h"
 #include "cfg.h"
 #include <clang-c/Index.h> /* -lclang */
 #include "dict.h"
 #include "set.h"
+#include "symtab.h"
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "stats.h"
 
-/* Visitor function for scanning a function for its callees. The set parameter
- * tracks the callee names of the function we're scanning.
+/* Traversal state of a function. */
+typedef enum {
+    FN_UNVISITED,
+    FN_ACTIVE,  /* currently on the traversal stack */
+    FN_DONE,    /* all reachable callees have been visited */
+} fn_state_t;
+
+/* Representation of a function and its callees. Definitions of global
+ * variables are represented the same way, with the functions their
+ * initialisers refer to as callees. Further definitions of the same name are
+ * chained to the first, and their callees are the first's.
+ */
+typedef struct fn {
+    CXCursor cursor;
+    sym_t name;
+    bool global;            /* a variable rather than a function */
+    bool internal;          /* static, so only referred to from this unit */
+    CXSourceRange body;     /* in CFG_TOKENS mode, the tokens to scan */
+    bool scanned;           /* whether we have looked for its callees */
+    size_t callees;         /* index of its first callee in the CFG's edges */
+    unsigned int callees_sz;
+    fn_state_t state;
+    struct fn *duplicate;   /* next definition of the same name, if any */
+    struct fn *sibling;     /* next variable declared in the same statement,
+                             * if any (see link_declarator) */
+    bool pinned;            /* static, but referred to from outside any
+                             * function definition (see find_pinned) */
+} fn_t;
+
+/* A pending function on the traversal stack, along with our progress through
+ * its callees.
+ */
+typedef struct {
+    fn_t *fn;
+    unsigned int next;      /* index of the next callee to visit */
+} frame_t;
+
+struct cfg {
+    cfg_mode_t mode;
+    CXTranslationUnit tu;
+    symtab_t *symtab;
+    arena_t *arena;     /* nodes and index entries, freed with the CFG */
+    cfg_decl_t *decls;  /* top-level declarations, in source order */
+    size_t decls_sz;
+    size_t decls_cap;
+    fn_t *current;      /* function being scanned */
+    dict_t *fns;        /* function name -> fn_t */
+    sym_t *edges;       /* callees of each function, contiguous per function
+                         * (i.e. the columns of a CSR adjacency matrix) */
+    size_t edges_sz;
+    size_t edges_cap;
+    bitset_t *marked;   /* callees of the function being scanned so far */
+    set_t *undefined;   /* undefined callees we have already reported */
+    frame_t *stack;
+    size_t stack_sz;
+    size_t stack_cap;
+    dict_t *index;      /* declaration key -> decl_list_t (see cfg_needed) */
+    sym_t *keys;        /* key of each top-level declaration, or SYM_NONE */
+};
+
+/* Finish recording the callees of the function being scanned, if any. */
+static void end_scan(cfg_t *c) {
+    if (c->current == NULL)
+        return;
+    for (unsigned int i = 0; i < c->current->callees_sz; i++)
+        bitset_remove(c->marked, c->edges[c->current->callees + i]);
+    c->current = NULL;
+}
+
+/* Start recording the callees of a function. As only one function is scanned
+ * at a time, each one's callees occupy a contiguous run of the edges.
+ */
+static void begin_scan(cfg_t *c, fn_t *f) {
+    end_scan(c);
+    f->scanned = true;
+    f->callees = c->edges_sz;
+    f->callees_sz = 0;
+    c->current = f;
+}
+
+/* Record a callee of the function being scanned, unless it is already one.
+ * Returns non-zero on failure.
+ */
+static int add_callee(cfg_t *c, sym_t callee) {
+    if (bitset_contains(c->marked, callee))
+        return 0;
+
+    if (c->edges_sz == c->edges_cap) {
+        size_t cap = c->edges_cap == 0 ? 4096 : c->edges_cap * 2;
+        sym_t *edges = realloc(c->edges, cap * sizeof(*edges));
+        if (edges == NULL)
+            return -1;
+        c->edges = edges;
+        c->edges_cap = cap;
+    }
+
+    if (bitset_insert(c->marked, callee) != 0)
+        return -1;
+    c->edges[c->edges_sz++] = callee;
+    c->current->callees_sz++;
+    return 0;
+}
+
+/* Visitor function for scanning a function for its callees, which are added
+ * to the callees of the current function. Any reference to a function
+ * that is not a call (e.g. storing it in a table or passing it as a callback)
+ * counts as a call too, as we have no idea when it will be called. So does a
+ * reference to a static global variable, which nothing outside this
+ * translation unit can refer to, so that it is only retained if something
+ * that refers to it is.
  */
-static enum CXChildVisitResult scan_fn(CXCursor cursor, CXCursor _, set_t *s) {
-    /* Skip anything that's not a function call. */
-    if (clang_getCursorKind(cursor) != CXCursor_CallExpr)
+static enum CXChildVisitResult scan_fn(CXCursor cursor, CXCursor _, cfg_t *c) {
+    enum CXCursorKind kind = clang_getCursorKind(cursor);
+
+    if (kind == CXCursor_DeclRefExpr) {
+        CXCursor referenced = clang_getCursorReferenced(cursor);
+        enum CXCursorKind referenced_kind = clang_getCursorKind(referenced);
+        if (referenced_kind != CXCursor_FunctionDecl &&
+                (referenced_kind != CXCursor_VarDecl ||
+                 clang_getCursorLinkage(referenced) != CXLinkage_Internal))
+            return CXChildVisit_Recurse;
+    } else if (kind != CXCursor_CallExpr) {
+        /* Skip anything that's not a function call or reference. */
         return CXChildVisit_Recurse;
+    }
 
     /* Get the name of the callee. */
-    CXString sym = clang_getCursorSpelling(cursor);
-    char *name = strdup(clang_getCString(sym));
-    clang_disposeString(sym);
-    if (name == NULL)
+    CXString s = clang_getCursorSpelling(cursor);
+    sym_t callee = symtab_intern(c->symtab, clang_getCString(s));
+    clang_disposeString(s);
+    if (callee == SYM_NONE || add_callee(c, callee) != 0)
         return CXChildVisit_Break;
 
-    set_insert(s, name);
-
     return CXChildVisit_Recurse;
 }
 
-/* Representation of a function and its callees. */
-typedef struct {
-    CXCursor cursor;
-    set_t *callees;
-} fn_t;
+/* Whether a token is the given punctuation. */
+static bool is_punctuation(CXTranslationUnit tu, CXToken token,
+        const char *punctuation) {
+    if (clang_getTokenKind(token) != CXToken_Punctuation)
+        return false;
+    CXString s = clang_getTokenSpelling(tu, token);
+    bool match = !strcmp(clang_getCString(s), punctuation);
+    clang_disposeString(s);
+    return match;
+}
 
-/* Visitor function for recursively visiting a function's callees with the
- * user's provided visitor.
+/* Scan the tokens of a function's body for its callees, which are added to the
+ * callees of the current function. Without looking at the AST, we consider any
+ * identifier followed by an opening parenthesis to be a call, and any other
+ * mention of a function (or global) defined in this translation unit to be
+ * one too (its address is probably being taken, so it may be called
+ * indirectly). This
+ * over-approximates (e.g. it picks up block-scope prototypes and struct
+ * members that share a function's name), which only ever causes us to retain
+ * more than we need. Returns non-zero on failure.
  */
-static enum CXChildVisitResult visit_callees(cfg_t *c, fn_t *f,
-        cfg_visitor_t visitor, void *data) {
+static int scan_tokens(cfg_t *c, const fn_t *f) {
+    CXToken *tokens;
+    unsigned int tokens_sz;
+    clang_tokenize(c->tu, f->body, &tokens, &tokens_sz);
+
+    int ret = 0;
+    for (unsigned int i = 0; i < tokens_sz; i++) {
+        if (clang_getTokenKind(tokens[i]) != CXToken_Identifier)
+            continue;
 
-    if (!f->callees) {
+        CXString s = clang_getTokenSpelling(c->tu, tokens[i]);
+        const char *name = clang_getCString(s);
+        sym_t callee;
+        if (i + 1 < tokens_sz && is_punctuation(c->tu, tokens[i + 1], "(")) {
+            callee = symtab_intern(c->symtab, name);
+            if (callee == SYM_NONE)
+                ret = -1;
+        } else if (!symtab_lookup(c->symtab, name, &callee) ||
+                !dict_contains(c->fns, callee)) {
+            /* Not a function, as far as we know. */
+            callee = SYM_NONE;
+        }
+        clang_disposeString(s);
+
+        if (ret == 0 && callee != SYM_NONE)
+            ret = add_callee(c, callee);
+        if (ret != 0)
+            break;
+    }
+
+    clang_disposeTokens(c->tu, tokens, tokens_sz);
+    return ret;
+}
+
+/* Scan a function, and any other definitions of it, for its callees if we
+ * have not yet looked inside it. Returns non-zero on failure.
+ */
+static int scan(cfg_t *c, fn_t *f) {
+    int ret = 0;
+
+    if (!f->scanned) {
         /* We haven't yet looked inside this function. */
-        f->callees = set();
-        if (f->callees == NULL)
-            return CXChildVisit_Break;
-        if (clang_visitChildren(f->cursor, (CXCursorVisitor)scan_fn, f->callees) != 0)
-            return CXChildVisit_Break;
+        begin_scan(c, f);
+        for (const fn_t *g = f; g != NULL && ret == 0; g = g->duplicate) {
+            if (c->mode == CFG_TOKENS)
+                ret = scan_tokens(c, g);
+            else if (clang_visitChildren(g->cursor, (CXCursorVisitor)scan_fn,
+                    c) != 0)
+                ret = -1;
+        }
+        if (ret == 0 && f->sibling != NULL)
+            ret = add_callee(c, f->sibling->name);
+        end_scan(c);
     }
 
-    CXString s = clang_getCursorSpelling(f->cursor);
-    const char *name = clang_getCString(s);
+    return ret;
+}
 
-    set_iter_t i;
-    set_iter(f->callees, &i);
+/* Push a function onto the traversal stack, scanning it for its callees if
+ * necessary. Returns non-zero on failure.
+ */
+static int push(cfg_t *c, fn_t *f) {
 
-    while (true) {
-        const char *current = set_iter_next(&i);
-        if (current == NULL)
-            /* Iterator exhausted. */
-            break;
+    if (scan(c, f) != 0)
+        return -1;
+
+    if (c->stack_sz == c->stack_cap) {
+        size_t cap = c->stack_cap == 0 ? 64 : c->stack_cap * 2;
+        frame_t *stack = realloc(c->stack, cap * sizeof(*stack));
+        if (stack == NULL)
+            return -1;
+        c->stack = stack;
+        c->stack_cap = cap;
+    }
+
+    frame_t *top = &c->stack[c->stack_sz++];
+    top->fn = f;
+    top->next = 0;
+    f->state = FN_ACTIVE;
+    return 0;
+}
 
-        switch (visitor(current, name, data)) {
+int cfg_visit_callees(cfg_t *c, sym_t name, cfg_visitor_t visitor,
+        cfg_cycle_visitor_t on_cycle, void *data) {
+
+    fn_t *f = dict_get(c->fns, name);
+    if (f == NULL) {
+        /* Function not found. */
+        visitor(SYM_NONE, name, data);
+        return -1;
+    }
+
+    if (f->state != FN_UNVISITED)
+        /* Already traversed from a previous root. */
+        return 0;
+
+    if (push(c, f) != 0)
+        return 1;
+
+    while (c->stack_sz > 0) {
+        frame_t *top = &c->stack[c->stack_sz - 1];
+        sym_t caller = top->fn->name;
+
+        if (top->next == top->fn->callees_sz) {
+            /* Callees exhausted. */
+            top->fn->state = FN_DONE;
+            c->stack_sz--;
+            continue;
+        }
+        sym_t current = c->edges[top->fn->callees + top->next++];
+
+        switch (visitor(current, caller, data)) {
 
             case CXChildVisit_Break:
                 goto fail;
 
             case CXChildVisit_Recurse:;
-                fn_t *callee = dict_get(c, current);
+                fn_t *callee = dict_get(c->fns, current);
 
                 if (callee == NULL) {
                     /* This function has no known definition. */
-                    if (visitor(NULL, current, data) == CXChildVisit_Break)
+                    if (set_contains(c->undefined, current))
+                        break;
+                    set_insert(c->undefined, current);
+                    if (visitor(SYM_NONE, current, data) == CXChildVisit_Break)
                         goto fail;
                     break;
                 }
 
-                if (visit_callees(c, callee, visitor, data) == CXChildVisit_Break)
+                if (callee->state == FN_ACTIVE) {
+                    /* Recursion. Don't follow this edge. */
+                    if (on_cycle != NULL)
+                        on_cycle(current, caller, data);
+                    break;
+                }
+
+                if (callee->state == FN_DONE)
+                    break;
+
+                if (push(c, callee) != 0)
                     /* Abort traversal. */
                     goto fail;
 
@@ -94,75 +327,1207 @@ static enum CXChildVisitResult visit_callees(cfg_t *c, fn_t *f,
         }
     }
 
-    clang_disposeString(s);
-    return CXChildVisit_Continue;
+    return 0;
 
-fail: clang_disposeString(s);
-    return CXChildVisit_Break;
+fail:
+    /* Functions we were partway through are left unvisited so a later
+     * traversal can retry them.
+     */
+    while (c->stack_sz > 0)
+        c->stack[--c->stack_sz].fn->state = FN_UNVISITED;
+    return 1;
 }
 
-int cfg_visit_callees(cfg_t *c, const char *name, cfg_visitor_t visitor,
-        void *data) {
-
-    fn_t *f = dict_get(c, name);
-    if (f == NULL) {
-        /* Function not found. */
-        visitor(NULL, name, data);
-        return -1;
+/* Append a top-level declaration to the CFG's table. Returns NULL on failure.
+ */
+static cfg_decl_t *add_decl(cfg_t *c, CXCursor cursor, sym_t name) {
+    if (c->decls_sz == c->decls_cap) {
+        size_t cap = c->decls_cap == 0 ? 1024 : c->decls_cap * 2;
+        cfg_decl_t *decls = realloc(c->decls, cap * sizeof(*decls));
+        if (decls == NULL)
+            return NULL;
+        c->decls = decls;
+        c->decls_cap = cap;
     }
 
-    return visit_callees(c, f, visitor, data) == CXChildVisit_Break;
+    cfg_decl_t *d = &c->decls[c->decls_sz++];
+    d->cursor = cursor;
+    d->kind = clang_getCursorKind(cursor);
+    d->name = name;
+    d->extent = clang_getCursorExtent(cursor);
+    d->definition = clang_isCursorDefinition(cursor);
+    d->internal = (d->kind == CXCursor_FunctionDecl ||
+            d->kind == CXCursor_VarDecl) &&
+        clang_getCursorLinkage(cursor) == CXLinkage_Internal;
+    return d;
 }
 
-static enum CXChildVisitResult visit_tu(CXCursor cursor, CXCursor _, cfg_t *c) {
+/* Whether a top-level declaration is represented in the CFG: a function or
+ * global variable definition, or any declaration of a static variable. A
+ * static variable's tentative definition (e.g. 'static int n;') is often its
+ * only one, and something may still refer to it.
+ */
+static bool is_node(const cfg_decl_t *d) {
+    return (d->kind == CXCursor_FunctionDecl && d->definition) ||
+        (d->kind == CXCursor_VarDecl && (d->definition || d->internal));
+}
 
-    /* Skip anything that's not a function. */
-    if (clang_getCursorKind(cursor) != CXCursor_FunctionDecl)
-        return CXChildVisit_Continue;
+/* The representation of a top-level declaration in the CFG, or NULL if it has
+ * none.
+ */
+static fn_t *node_of(cfg_t *c, const cfg_decl_t *d) {
+    if (!is_node(d))
+        return NULL;
+    fn_t *f = dict_get(c->fns, d->name);
+    while (f != NULL && !clang_equalCursors(f->cursor, d->cursor))
+        f = f->duplicate;
+    return f;
+}
 
-    /* Skip function declarations that are not definitions. */
-    if (!clang_isCursorDefinition(cursor))
-        return CXChildVisit_Continue;
+/* The node of a top-level declaration if it is the first definition of its
+ * name, which stands for any others, or NULL.
+ */
+static fn_t *first_node(cfg_t *c, const cfg_decl_t *d) {
+    fn_t *f = node_of(c, d);
+    return f != NULL && f == dict_get(c->fns, d->name) ? f : NULL;
+}
+
+/* Offset of a source location within its file. */
+static unsigned int offset_of(CXSourceLocation location) {
+    unsigned int offset;
+    clang_getSpellingLocation(location, NULL, NULL, NULL, &offset);
+    return offset;
+}
+
+/* With 'static int x = 1, y = 2;', Clang gives us x and y as separate
+ * declarations starting at the same place, but only the last of them is
+ * emitted, with the text of both (see emit() in prune.c). So the variables of
+ * one statement are linked in a ring, and each is a callee of the next, so
+ * that all of them are retained if any is. Adds a variable to the ring of the
+ * one declared before it if they share a statement.
+ */
+static void link_declarator(cfg_t *c, fn_t *f) {
+    if (c->decls_sz < 2)
+        return;
+    const cfg_decl_t *d = &c->decls[c->decls_sz - 1];
+    const cfg_decl_t *prev = &c->decls[c->decls_sz - 2];
+    if (prev->kind != CXCursor_VarDecl || !is_node(prev) ||
+            prev->name == d->name ||
+            offset_of(clang_getRangeStart(prev->extent)) !=
+            offset_of(clang_getRangeStart(d->extent)))
+        return;
+
+    fn_t *g = dict_get(c->fns, prev->name);
+    f->sibling = g->sibling == NULL ? g : g->sibling;
+    g->sibling = f;
+    /* If eager, its callees so far lack its new sibling. */
+    g->scanned = false;
+}
+
+static enum CXChildVisitResult visit_tu(CXCursor cursor, CXCursor parent,
+        cfg_t *c) {
+
+    if (clang_getCursorKind(parent) != CXCursor_TranslationUnit) {
+        /* We are inside the body of a function we are eagerly scanning. */
+        assert(c->current != NULL);
+        return scan_fn(cursor, parent, c);
+    }
+    end_scan(c);
 
-    /* Determine the name of the current function. */
+    /* Determine the name of the current declaration. */
     CXString s = clang_getCursorSpelling(cursor);
-    char *name = strdup(clang_getCString(s));
+    sym_t name = symtab_intern(c->symtab, clang_getCString(s));
     clang_disposeString(s);
-    if (name == NULL) {
+    if (name == SYM_NONE) {
         fprintf(stderr, "failed to allocate memory\n");
-        goto fail;
-    } else if (dict_contains(c, name)) {
-        fprintf(stderr, "duplicate definition for function %s\n", name);
-        goto fail;
+        return CXChildVisit_Break;
+    }
+
+    const cfg_decl_t *d = add_decl(c, cursor, name);
+    if (d == NULL) {
+        fprintf(stderr, "failed to allocate memory\n");
+        return CXChildVisit_Break;
     }
 
-    /* Construct a lazy (uninitialised) representation of its callees. */
-    fn_t *f = calloc(1, sizeof(*f));
+    /* Skip anything that's not a function or global variable definition (or
+     * static variable).
+     */
+    if (!is_node(d))
+        return CXChildVisit_Continue;
+
+    /* Construct a representation of its callees. Unless we were asked to be
+     * eager, this is lazy (uninitialised).
+     */
+    fn_t *f = arena_alloc(c->arena, sizeof(*f));
     if (f == NULL)
-        goto fail;
+        return CXChildVisit_Break;
     f->cursor = cursor;
+    f->name = name;
+    f->global = d->kind == CXCursor_VarDecl;
+    f->internal = d->internal;
+
+    fn_t *first = dict_get(c->fns, name);
+    if (first != NULL) {
+        /* Further declarations of a static variable are expected. Otherwise
+         * these are probably both sides of a conditional the configuration
+         * does not exclude. Whichever is emitted, its callees need to be
+         * retained, so the declarations are scanned together (afresh, if
+         * eager) as one.
+         */
+        bool defined = false;
+        fn_t **last = &first;
+        while (*last != NULL) {
+            defined |= clang_isCursorDefinition((*last)->cursor);
+            last = &(*last)->duplicate;
+        }
+        if (defined && d->definition)
+            fprintf(stderr, "Warning: duplicate definition for %s %s\n",
+                d->kind == CXCursor_VarDecl ? "variable" : "function",
+                symtab_name(c->symtab, name));
+        *last = f;
+        first->internal &= f->internal;
+        first->scanned = false;
+        return CXChildVisit_Continue;
+    }
 
     /* Add this function to the CFG. */
-    dict_set(c, name, f);
+    dict_set(c->fns, name, f);
+    if (f->global)
+        link_declarator(c, f);
+
+    if (c->mode == CFG_EAGER) {
+        /* Scan the function's callees as part of this same traversal. */
+        begin_scan(c, f);
+        if (f->sibling != NULL && add_callee(c, f->sibling->name) != 0)
+            return CXChildVisit_Break;
+        return CXChildVisit_Recurse;
+    }
 
     return CXChildVisit_Continue;
+}
+
+/* Find the body of a function definition whose body was skipped during
+ * parsing, by matching braces in the tokens between the function's name and
+ * the given bound (the start of the following declaration). The function's
+ * declaration is extended to cover the body. If no body can be found, the
+ * whole span up to the bound is taken as the body, so a later scan of it for
+ * callees errs on the side of finding too many.
+ */
+static void find_body(cfg_t *c, cfg_decl_t *d, fn_t *f,
+        CXSourceLocation bound) {
+
+    CXSourceLocation start = clang_getRangeStart(d->extent);
+    CXSourceRange span = clang_getRange(start, bound);
+    f->body = span;
+
+    CXToken *tokens;
+    unsigned int tokens_sz;
+    clang_tokenize(c->tu, span, &tokens, &tokens_sz);
 
-fail: free(name);
-    return CXChildVisit_Break;
+    /* Skip the return type, which may itself contain braces (an inline struct
+     * definition). The body is the first brace after the name that is not
+     * inside parentheses (e.g. an __attribute__).
+     */
+    unsigned int name = offset_of(clang_getCursorLocation(d->cursor));
+    unsigned int parens = 0, braces = 0;
+    CXSourceLocation open = start;
+    for (unsigned int i = 0; i < tokens_sz; i++) {
+        CXSourceRange extent = clang_getTokenExtent(c->tu, tokens[i]);
+        if (offset_of(clang_getRangeStart(extent)) < name ||
+                clang_getTokenKind(tokens[i]) != CXToken_Punctuation)
+            continue;
+
+        CXString s = clang_getTokenSpelling(c->tu, tokens[i]);
+        const char *p = clang_getCString(s);
+        if (!strcmp(p, "(")) {
+            parens++;
+        } else if (!strcmp(p, ")")) {
+            if (parens > 0)
+                parens--;
+        } else if (!strcmp(p, "{") && parens == 0) {
+            if (braces++ == 0)
+                open = clang_getRangeStart(extent);
+        } else if (!strcmp(p, "}") && braces > 0) {
+            if (--braces == 0) {
+                CXSourceLocation close = clang_getRangeEnd(extent);
+                f->body = clang_getRange(open, close);
+                d->extent = clang_getRange(start, close);
+                clang_disposeString(s);
+                break;
+            }
+        }
+        clang_disposeString(s);
+    }
+
+    clang_disposeTokens(c->tu, tokens, tokens_sz);
 }
 
-cfg_t *cfg(CXTranslationUnit tu) {
-    cfg_t *c = dict(NULL);
+/* Find the initialiser of a global variable definition: the tokens following
+ * the first '=' after its name that is not inside parentheses (e.g. an
+ * __attribute__). Anything before it can only name types.
+ */
+static void find_initialiser(cfg_t *c, const cfg_decl_t *d, fn_t *f) {
+    CXSourceLocation end = clang_getRangeEnd(d->extent);
+    f->body = clang_getRange(end, end);
+
+    CXToken *tokens;
+    unsigned int tokens_sz;
+    clang_tokenize(c->tu, d->extent, &tokens, &tokens_sz);
+
+    unsigned int name = offset_of(clang_getCursorLocation(d->cursor));
+    unsigned int parens = 0;
+    for (unsigned int i = 0; i < tokens_sz; i++) {
+        CXSourceRange extent = clang_getTokenExtent(c->tu, tokens[i]);
+        if (offset_of(clang_getRangeStart(extent)) < name ||
+                clang_getTokenKind(tokens[i]) != CXToken_Punctuation)
+            continue;
+
+        CXString s = clang_getTokenSpelling(c->tu, tokens[i]);
+        const char *p = clang_getCString(s);
+        bool found = false;
+        if (!strcmp(p, "(")) {
+            parens++;
+        } else if (!strcmp(p, ")")) {
+            if (parens > 0)
+                parens--;
+        } else if (!strcmp(p, "=") && parens == 0) {
+            f->body = clang_getRange(clang_getRangeEnd(extent), end);
+            found = true;
+        }
+        clang_disposeString(s);
+        if (found)
+            break;
+    }
+
+    clang_disposeTokens(c->tu, tokens, tokens_sz);
+}
+
+/* Locate the skipped bodies of every function definition (see find_body) and
+ * the initialisers of global variables.
+ */
+static void find_bodies(cfg_t *c) {
+    CXCursor root = clang_getTranslationUnitCursor(c->tu);
+    CXSourceLocation end = clang_getRangeEnd(clang_getCursorExtent(root));
+
+    for (size_t i = 0; i < c->decls_sz; i++) {
+        cfg_decl_t *d = &c->decls[i];
+        if (d->kind == CXCursor_VarDecl && is_node(d)) {
+            fn_t *f = node_of(c, d);
+            assert(f != NULL);
+            find_initialiser(c, d, f);
+            continue;
+        }
+        if (d->kind != CXCursor_FunctionDecl || !d->definition)
+            continue;
+
+        /* The body ends before the next declaration starts, if there is one
+         * that plausibly follows this one.
+         */
+        CXSourceLocation bound = end;
+        if (i + 1 < c->decls_sz) {
+            CXSourceLocation next = clang_getRangeStart(c->decls[i + 1].extent);
+            if (offset_of(next) > offset_of(clang_getRangeEnd(d->extent)))
+                bound = next;
+        }
+
+        fn_t *f = node_of(c, d);
+        assert(f != NULL);
+        find_body(c, d, f, bound);
+    }
+}
+
+/* Mark the static variables referred to from outside any function definition
+ * as pinned: from the types, enumerators and prototypes that are emitted
+ * whatever is retained (e.g. 'enum { N = sizeof(table) / sizeof(table[0]) };'),
+ * and from declarations of variables that are not themselves definitions.
+ * Nothing reachable leads to these, but they are needed all the same.
+ */
+static void find_pinned(cfg_t *c) {
+    bool statics = false;
+    for (size_t i = 0; i < c->decls_sz && !statics; i++)
+        statics = c->decls[i].kind == CXCursor_VarDecl && c->decls[i].internal;
+    if (!statics)
+        return;
+
+    enum CXChildVisitResult ref(CXCursor cursor, CXCursor _, void *__) {
+        if (clang_getCursorKind(cursor) != CXCursor_DeclRefExpr)
+            return CXChildVisit_Recurse;
+        CXCursor referenced = clang_getCursorReferenced(cursor);
+        if (clang_getCursorKind(referenced) != CXCursor_VarDecl ||
+                clang_getCursorLinkage(referenced) != CXLinkage_Internal)
+            return CXChildVisit_Recurse;
+
+        CXString s = clang_getCursorSpelling(referenced);
+        sym_t name;
+        fn_t *f = NULL;
+        if (symtab_lookup(c->symtab, clang_getCString(s), &name))
+            f = dict_get(c->fns, name);
+        clang_disposeString(s);
+        if (f != NULL)
+            f->pinned = true;
+        return CXChildVisit_Recurse;
+    }
+
+    for (size_t i = 0; i < c->decls_sz; i++) {
+        const cfg_decl_t *d = &c->decls[i];
+        if (is_node(d) || (d->kind == CXCursor_FunctionDecl && d->definition))
+            continue;
+        clang_visitChildren(d->cursor, (CXCursorVisitor)ref, NULL);
+    }
+}
+
+/* Construct an empty CFG. Returns NULL on failure. */
+static cfg_t *create(cfg_mode_t mode, symtab_t *symtab) {
+    cfg_t *c = calloc(1, sizeof(*c));
+    if (c == NULL)
+        return NULL;
+    c->mode = mode;
+    c->symtab = symtab;
+    c->arena = arena();
+    if (c->arena == NULL)
+        goto fail1;
+    c->fns = dict(NULL);
+    if (c->fns == NULL)
+        goto fail2;
+    c->undefined = set();
+    if (c->undefined == NULL)
+        goto fail3;
+    c->marked = bitset();
+    if (c->marked == NULL)
+        goto fail4;
+    return c;
+
+fail4: set_destroy(c->undefined);
+fail3: dict_destroy(c->fns);
+fail2: arena_destroy(c->arena);
+fail1: free(c);
+    return NULL;
+}
+
+cfg_t *cfg(CXTranslationUnit tu, cfg_mode_t mode, symtab_t *symtab) {
+    cfg_t *c = create(mode, symtab);
     if (c == NULL)
         return NULL;
+    c->tu = tu;
     CXCursor cursor = clang_getTranslationUnitCursor(tu);
-    if (clang_visitChildren(cursor, (CXCursorVisitor)visit_tu, c) != 0) {
-        dict_destroy(c);
+    int err = clang_visitChildren(cursor, (CXCursorVisitor)visit_tu, c);
+    end_scan(c);
+    if (err != 0) {
+        cfg_destroy(c);
         return NULL;
     }
+    if (mode == CFG_TOKENS)
+        find_bodies(c);
+    find_pinned(c);
     return c;
 }
 
+cfg_t *cfg_global(symtab_t *symtab) {
+    return create(CFG_EAGER, symtab);
+}
+
+int cfg_merge(cfg_t *dst, cfg_t *src) {
+    for (size_t i = 0; i < src->decls_sz; i++) {
+        const cfg_decl_t *d = &src->decls[i];
+        fn_t *f = first_node(src, d);
+        if (f == NULL)
+            continue;
+        if (scan(src, f) != 0)
+            return -1;
+
+        fn_t *g = dict_get(dst->fns, d->name);
+        if (g == NULL) {
+            g = arena_alloc(dst->arena, sizeof(*g));
+            if (g == NULL)
+                return -1;
+            g->name = d->name;
+            g->global = f->global;
+            g->internal = f->internal;
+            dict_set(dst->fns, d->name, g);
+        } else {
+            /* Merged with a definition that may be referred to externally. */
+            g->internal &= f->internal;
+        }
+        g->pinned |= f->pinned;
+
+        /* A second definition of the same name needs its callees alongside
+         * the first's, so they are copied to a fresh run of edges, leaving
+         * the old run unused.
+         */
+        size_t previous = g->callees;
+        unsigned int previous_sz = g->scanned ? g->callees_sz : 0;
+        begin_scan(dst, g);
+        int err = 0;
+        for (unsigned int j = 0; j < previous_sz && err == 0; j++)
+            err = add_callee(dst, dst->edges[previous + j]);
+        for (unsigned int j = 0; j < f->callees_sz && err == 0; j++)
+            err = add_callee(dst, src->edges[f->callees + j]);
+        end_scan(dst);
+        if (err != 0)
+            return -1;
+    }
+    return 0;
+}
+
+const cfg_decl_t *cfg_decls(cfg_t *c, size_t *count) {
+    *count = c->decls_sz;
+    return c->decls;
+}
+
+void cfg_count(cfg_t *c, unsigned long *functions, unsigned long *edges) {
+    *functions = 0;
+    *edges = 0;
+    void count(sym_t name __attribute__((unused)), void *value) {
+        fn_t *f = value;
+        if (!f->global)
+            (*functions)++;
+        if (f->scanned)
+            *edges += f->callees_sz;
+    }
+    dict_foreach(c->fns, count);
+}
+
+void cfg_globals(cfg_t *c, void (*f)(sym_t name)) {
+    void global(sym_t name, void *value) {
+        const fn_t *fn = value;
+        if (fn->global && (!fn->internal || fn->pinned))
+            f(name);
+    }
+    dict_foreach(c->fns, global);
+}
+
+void cfg_definitions(cfg_t *c, void (*f)(sym_t name)) {
+    void definition(sym_t name, void *value __attribute__((unused))) {
+        f(name);
+    }
+    dict_foreach(c->fns, definition);
+}
+
+void cfg_reset(cfg_t *c) {
+    void reset(sym_t name __attribute__((unused)), void *value) {
+        ((fn_t*)value)->state = FN_UNVISITED;
+    }
+    dict_foreach(c->fns, reset);
+    set_clear(c->undefined);
+}
+
+/* Scan every function of a CFG for its callees. Returns non-zero on failure.
+ */
+static int scan_all(cfg_t *c) {
+    int ret = 0;
+    void scan_one(sym_t name __attribute__((unused)), void *value) {
+        if (ret == 0)
+            ret = scan(c, value);
+    }
+    dict_foreach(c->fns, scan_one);
+    return ret;
+}
+
+int cfg_chain(cfg_t *c, const bitset_t *roots, sym_t target, sym_t **chain,
+        size_t *chain_sz) {
+    int ret = -1;
+
+    /* With every function scanned, no callee can be interned after this. */
+    if (scan_all(c) != 0)
+        goto fail1;
+    unsigned int syms = symtab_size(c->symtab);
+
+    /* Breadth-first search from all the roots at once, remembering how we
+     * first reached each function. Roots are their own predecessors.
+     */
+    sym_t *pred = malloc(syms * sizeof(*pred));
+    if (pred == NULL)
+        goto fail1;
+    memset(pred, 0xff, syms * sizeof(*pred));
+    sym_t *queue = malloc(syms * sizeof(*queue));
+    if (queue == NULL)
+        goto fail2;
+    size_t head = 0, tail = 0;
+
+    void enqueue(sym_t root) {
+        if (root < syms && pred[root] == SYM_NONE) {
+            pred[root] = root;
+            queue[tail++] = root;
+        }
+    }
+    bitset_foreach(roots, enqueue);
+
+    bool found = target < syms && pred[target] != SYM_NONE;
+    while (!found && head < tail) {
+        sym_t caller = queue[head++];
+        const fn_t *f = dict_get(c->fns, caller);
+        if (f == NULL)
+            /* An undefined function, which calls nothing we know of. */
+            continue;
+        for (unsigned int i = 0; i < f->callees_sz && !found; i++) {
+            sym_t callee = c->edges[f->callees + i];
+            if (pred[callee] != SYM_NONE)
+                continue;
+            pred[callee] = caller;
+            queue[tail++] = callee;
+            found = callee == target;
+        }
+    }
+
+    if (!found) {
+        *chain = NULL;
+        *chain_sz = 0;
+        ret = 1;
+        goto fail3;
+    }
+
+    /* Walk back to the root, then reverse. */
+    size_t n = 1;
+    for (sym_t s = target; pred[s] != s; s = pred[s])
+        n++;
+    *chain = malloc(n * sizeof(**chain));
+    if (*chain == NULL)
+        goto fail3;
+    *chain_sz = n;
+    sym_t s = target;
+    for (size_t i = n; i > 0; i--) {
+        (*chain)[i - 1] = s;
+        s = pred[s];
+    }
+    ret = 0;
+
+fail3: free(queue);
+fail2: free(pred);
+fail1: return ret;
+}
+
+int cfg_dump(cfg_t *c, FILE *f, cfg_format_t format,
+        const bitset_t *retained) {
+    int ret = -1;
+
+    if (scan_all(c) != 0)
+        goto fail1;
+
+    size_t fns_sz = 0;
+    fn_t **fns = malloc((dict_size(c->fns) + 1) * sizeof(*fns));
+    if (fns == NULL)
+        goto fail1;
+    void collect(sym_t name __attribute__((unused)), void *value) {
+        fns[fns_sz++] = value;
+    }
+    dict_foreach(c->fns, collect);
+
+    /* Order functions by name, so graphs are written deterministically. The
+     * names' symbols are no use for this, as their order depends on which
+     * thread interned what first.
+     */
+    int by_name(const void *a, const void *b) {
+        return strcmp(symtab_name(c->symtab, (*(const fn_t *const*)a)->name),
+            symtab_name(c->symtab, (*(const fn_t *const*)b)->name));
+    }
+    qsort(fns, fns_sz, sizeof(*fns), by_name);
+
+    /* Callees without a definition, each listed once, by name too. */
+    bitset_t *undefined = bitset();
+    if (undefined == NULL)
+        goto fail2;
+    for (size_t i = 0; i < fns_sz; i++) {
+        for (unsigned int j = 0; j < fns[i]->callees_sz; j++) {
+            sym_t callee = c->edges[fns[i]->callees + j];
+            if (!dict_contains(c->fns, callee) &&
+                    bitset_insert(undefined, callee) != 0)
+                goto fail3;
+        }
+    }
+    size_t missing_sz = 0;
+    sym_t *missing = malloc((bitset_size(undefined) + 1) * sizeof(*missing));
+    if (missing == NULL)
+        goto fail3;
+    void collect_missing(sym_t sym) {
+        missing[missing_sz++] = sym;
+    }
+    bitset_foreach(undefined, collect_missing);
+    int by_symbol_name(const void *a, const void *b) {
+        return strcmp(symtab_name(c->symtab, *(const sym_t*)a),
+            symtab_name(c->symtab, *(const sym_t*)b));
+    }
+    qsort(missing, missing_sz, sizeof(*missing), by_symbol_name);
+
+    /* Names are quoted as JSON strings in either format, which DOT accepts
+     * for the identifiers we see in practice.
+     */
+    void name(sym_t sym) {
+        stats_print_string(f, symtab_name(c->symtab, sym));
+    }
+
+    if (format == CFG_DOT) {
+        fprintf(f, "digraph cfg {\n");
+        for (size_t i = 0; i < fns_sz; i++) {
+            fputs("  ", f);
+            name(fns[i]->name);
+            fprintf(f, " [shape=%s%s];\n", fns[i]->global ? "box" : "ellipse",
+                retained != NULL && bitset_contains(retained, fns[i]->name) ?
+                    ",style=bold" : "");
+        }
+        for (size_t i = 0; i < missing_sz; i++) {
+            fputs("  ", f);
+            name(missing[i]);
+            fputs(" [style=dashed];\n", f);
+        }
+        for (size_t i = 0; i < fns_sz; i++) {
+            for (unsigned int j = 0; j < fns[i]->callees_sz; j++) {
+                fputs("  ", f);
+                name(fns[i]->name);
+                fputs(" -> ", f);
+                name(c->edges[fns[i]->callees + j]);
+                fputs(";\n", f);
+            }
+        }
+        fprintf(f, "}\n");
+
+    } else {
+        fprintf(f, "{\"nodes\":[");
+        for (size_t i = 0; i < fns_sz; i++) {
+            fprintf(f, "%s{\"name\":", i == 0 ? "" : ",");
+            name(fns[i]->name);
+            fprintf(f, ",\"kind\":\"%s\"", fns[i]->global ? "variable" :
+                "function");
+            if (retained != NULL)
+                fprintf(f, ",\"retained\":%s",
+                    bitset_contains(retained, fns[i]->name) ? "true" : "false");
+            fprintf(f, ",\"callees\":[");
+            for (unsigned int j = 0; j < fns[i]->callees_sz; j++) {
+                if (j > 0)
+                    fputc(',', f);
+                name(c->edges[fns[i]->callees + j]);
+            }
+            fprintf(f, "]}");
+        }
+        fprintf(f, "],\"undefined\":[");
+        for (size_t i = 0; i < missing_sz; i++) {
+            if (i > 0)
+                fputc(',', f);
+            name(missing[i]);
+        }
+        fprintf(f, "]}\n");
+    }
+
+    if (!ferror(f))
+        ret = 0;
+
+    free(missing);
+fail3: bitset_destroy(undefined);
+fail2: free(fns);
+fail1: return ret;
+}
+
+/* Serialised CFG format. All integers are 32-bit and in host byte order; the
+ * file is a cache, not an interchange format.
+ *
+ *   magic     CFG_MAGIC (no terminator)
+ *   version   CFG_VERSION
+ *   scan      how callees were found (see scan_kind)
+ *   key       length, then bytes
+ *   strings   count, then for each: length, then bytes
+ *   functions count, then for each: name string, callee count, callee strings
+ */
+#define CFG_MAGIC "PRUNECFG"
+#define CFG_VERSION 5
+
+/* How a CFG finds callees, which decides which it finds (e.g. a token scan
+ * sees calls through macros the AST does not). Lazy and eager CFGs scan the
+ * same way, so either can use the other's saved graph.
+ */
+static uint32_t scan_kind(const cfg_t *c) {
+    return c->mode == CFG_TOKENS ? 1 : 0;
+}
+
+int cfg_serialise(cfg_t *c, FILE *f, const char *key) {
+    int ret = -1;
+
+    /* Make sure we know every function's callees. */
+    uint32_t fns = 0;
+    for (size_t i = 0; i < c->decls_sz; i++) {
+        fn_t *fn = first_node(c, &c->decls[i]);
+        if (fn == NULL)
+            continue;
+        if (scan(c, fn) != 0)
+            return -1;
+        fns++;
+    }
+
+    /* Number the symbols we refer to, in order of first use. */
+    unsigned int syms = symtab_size(c->symtab);
+    uint32_t *index = malloc(syms * sizeof(*index));
+    if (index == NULL)
+        return -1;
+    memset(index, 0xff, syms * sizeof(*index));
+    sym_t *strings = malloc(syms * sizeof(*strings));
+    if (strings == NULL)
+        goto fail1;
+    uint32_t strings_sz = 0;
+
+    void number(sym_t sym) {
+        if (index[sym] == UINT32_MAX) {
+            index[sym] = strings_sz;
+            strings[strings_sz++] = sym;
+        }
+    }
+
+    for (size_t i = 0; i < c->decls_sz; i++) {
+        fn_t *fn = first_node(c, &c->decls[i]);
+        if (fn == NULL)
+            continue;
+        number(fn->name);
+        for (unsigned int j = 0; j < fn->callees_sz; j++)
+            number(c->edges[fn->callees + j]);
+    }
+
+    bool ok = true;
+    void put(uint32_t value) {
+        ok &= fwrite(&value, sizeof(value), 1, f) == 1;
+    }
+    void put_bytes(const char *data, uint32_t len) {
+        put(len);
+        ok &= fwrite(data, 1, len, f) == len;
+    }
+
+    ok &= fwrite(CFG_MAGIC, 1, strlen(CFG_MAGIC), f) == strlen(CFG_MAGIC);
+    put(CFG_VERSION);
+    put(scan_kind(c));
+    put_bytes(key, strlen(key));
+
+    put(strings_sz);
+    for (uint32_t i = 0; i < strings_sz; i++) {
+        const char *name = symtab_name(c->symtab, strings[i]);
+        put_bytes(name, strlen(name));
+    }
+
+    put(fns);
+    for (size_t i = 0; i < c->decls_sz; i++) {
+        fn_t *fn = first_node(c, &c->decls[i]);
+        if (fn == NULL)
+            continue;
+        put(index[fn->name]);
+        put(fn->callees_sz);
+        for (unsigned int j = 0; j < fn->callees_sz; j++)
+            put(index[c->edges[fn->callees + j]]);
+    }
+
+    if (ok)
+        ret = 0;
+
+    free(strings);
+fail1: free(index);
+    return ret;
+}
+
+int cfg_deserialise(cfg_t *c, const char *data, size_t size, const char *key) {
+    const char *p = data;
+    const char *end = data + size;
+    sym_t *strings = NULL;
+    int ret = -1;
+
+    /* Readers for the fields of the format. These fail (return false) rather
+     * than run off the end of a truncated or corrupt file.
+     */
+    bool get(uint32_t *value) {
+        if ((size_t)(end - p) < sizeof(*value))
+            return false;
+        memcpy(value, p, sizeof(*value));
+        p += sizeof(*value);
+        return true;
+    }
+    bool get_bytes(const char **bytes, uint32_t *len) {
+        if (!get(len) || (size_t)(end - p) < *len)
+            return false;
+        *bytes = p;
+        p += *len;
+        return true;
+    }
+
+    if ((size_t)(end - p) < strlen(CFG_MAGIC) ||
+            memcmp(p, CFG_MAGIC, strlen(CFG_MAGIC)))
+        goto done;
+    p += strlen(CFG_MAGIC);
+
+    uint32_t version, scan, len;
+    const char *bytes;
+    if (!get(&version) || version != CFG_VERSION)
+        goto done;
+    if (!get(&scan) || scan != scan_kind(c))
+        /* Saved by a different mode. */
+        goto done;
+    if (!get_bytes(&bytes, &len) || len != strlen(key) ||
+            memcmp(bytes, key, len))
+        /* Stale entry. */
+        goto done;
+
+    uint32_t strings_sz;
+    if (!get(&strings_sz) || strings_sz > (size_t)(end - p) / sizeof(uint32_t))
+        goto done;
+    strings = malloc(strings_sz * sizeof(*strings));
+    if (strings == NULL)
+        goto done;
+    for (uint32_t i = 0; i < strings_sz; i++) {
+        if (!get_bytes(&bytes, &len))
+            goto done;
+        char *name = strndup(bytes, len);
+        if (name == NULL)
+            goto done;
+        strings[i] = symtab_intern(c->symtab, name);
+        free(name);
+        if (strings[i] == SYM_NONE)
+            goto done;
+    }
+
+    uint32_t fns;
+    if (!get(&fns))
+        goto done;
+    for (uint32_t i = 0; i < fns; i++) {
+        uint32_t name, callees;
+        if (!get(&name) || name >= strings_sz || !get(&callees))
+            goto done;
+
+        /* The entry must describe exactly the functions we found. */
+        fn_t *f = dict_get(c->fns, strings[name]);
+        if (f == NULL || f->scanned)
+            goto done;
+
+        begin_scan(c, f);
+        for (uint32_t j = 0; j < callees; j++) {
+            uint32_t callee;
+            if (!get(&callee) || callee >= strings_sz ||
+                    add_callee(c, strings[callee]) != 0) {
+                end_scan(c);
+                goto done;
+            }
+        }
+        end_scan(c);
+    }
+
+    if (p == end && fns == dict_size(c->fns))
+        ret = 0;
+
+done:
+    free(strings);
+    return ret;
+}
+
+/* The top-level declarations that make up (part of) the definition of a given
+ * key. */
+typedef struct {
+    size_t *decls;
+    size_t sz;
+    size_t cap;
+} decl_list_t;
+
+/* Record that a declaration is needed whenever a key is. Returns non-zero on
+ * failure.
+ */
+static int index_add(cfg_t *c, sym_t key, size_t decl) {
+    decl_list_t *l = dict_get(c->index, key);
+    if (l == NULL) {
+        l = arena_alloc(c->arena, sizeof(*l));
+        if (l == NULL)
+            return -1;
+        dict_set(c->index, key, l);
+    }
+    if (l->sz > 0 && l->decls[l->sz - 1] == decl)
+        return 0;
+    if (l->sz == l->cap) {
+        size_t cap = l->cap == 0 ? 2 : l->cap * 2;
+        /* The old array is left in the arena, which at most doubles the
+         * space these take.
+         */
+        size_t *decls = arena_alloc(c->arena, cap * sizeof(*decls));
+        if (decls == NULL)
+            return -1;
+        if (l->sz > 0)
+            memcpy(decls, l->decls, l->sz * sizeof(*decls));
+        l->decls = decls;
+        l->cap = cap;
+    }
+    l->decls[l->sz++] = decl;
+    return 0;
+}
+
+/* Whether a cursor kind is a struct, union or enum. */
+static bool is_tag(enum CXCursorKind kind) {
+    return kind == CXCursor_StructDecl || kind == CXCursor_UnionDecl ||
+        kind == CXCursor_EnumDecl;
+}
+
+/* Key for a struct, union or enum, which live in a separate namespace to
+ * ordinary identifiers. Named tags are keyed as they would be written (e.g.
+ * "struct foo") so that references found in tokens can be looked up. Anonymous
+ * tags, which Clang spells either as nothing or as a description of their
+ * location, are keyed by their USR.
+ */
+static sym_t tag_key(cfg_t *c, CXCursor cursor) {
+    enum CXCursorKind kind = clang_getCursorKind(cursor);
+    const char *prefix = kind == CXCursor_StructDecl ? "struct " :
+                         kind == CXCursor_UnionDecl ? "union " : "enum ";
+
+    CXString s = clang_getCursorSpelling(cursor);
+    const char *name = clang_getCString(s);
+    sym_t key = SYM_NONE;
+    if (*name == '\0' || strchr(name, ' ') != NULL) {
+        CXString usr = clang_getCursorUSR(cursor);
+        key = symtab_intern(c->symtab, clang_getCString(usr));
+        clang_disposeString(usr);
+    } else {
+        char *tag = malloc(strlen(prefix) + strlen(name) + 1);
+        if (tag != NULL) {
+            strcpy(tag, prefix);
+            strcat(tag, name);
+            key = symtab_intern(c->symtab, tag);
+            free(tag);
+        }
+    }
+    clang_disposeString(s);
+    return key;
+}
+
+/* Key for the entity a reference refers to, or SYM_NONE if it is not
+ * something at the top level of the translation unit (e.g. a local variable
+ * or a parameter). Enumerators are keyed by their own name, which is indexed
+ * to their enum.
+ */
+static sym_t ref_key(cfg_t *c, CXCursor referenced) {
+    enum CXCursorKind kind = clang_getCursorKind(referenced);
+
+    if (is_tag(kind))
+        return tag_key(c, referenced);
+
+    if (kind != CXCursor_FunctionDecl && kind != CXCursor_VarDecl &&
+            kind != CXCursor_TypedefDecl && kind != CXCursor_EnumConstantDecl)
+        return SYM_NONE;
+
+    if (kind != CXCursor_EnumConstantDecl) {
+        CXCursor parent = clang_getCursorSemanticParent(referenced);
+        if (clang_getCursorKind(parent) != CXCursor_TranslationUnit)
+            return SYM_NONE;
+    }
+
+    CXString s = clang_getCursorSpelling(referenced);
+    sym_t key = symtab_intern(c->symtab, clang_getCString(s));
+    clang_disposeString(s);
+    return key;
+}
+
+/* Build the index from keys to the declarations they need. Returns non-zero on
+ * failure.
+ */
+static int build_index(cfg_t *c) {
+    c->index = dict(NULL);
+    if (c->index == NULL)
+        return -1;
+    c->keys = malloc((c->decls_sz + 1) * sizeof(*c->keys));
+    if (c->keys == NULL)
+        return -1;
+
+    int ret = 0;
+    for (size_t i = 0; i < c->decls_sz && ret == 0; i++) {
+        const cfg_decl_t *d = &c->decls[i];
+
+        sym_t key = SYM_NONE;
+        if (is_tag(d->kind))
+            key = tag_key(c, d->cursor);
+        else if (d->kind == CXCursor_FunctionDecl ||
+                d->kind == CXCursor_VarDecl || d->kind == CXCursor_TypedefDecl)
+            key = d->name;
+        c->keys[i] = key;
+        if (key == SYM_NONE)
+            continue;
+        if (index_add(c, key, i) != 0)
+            return -1;
+
+        /* Look for enumerators and inline tag definitions. */
+        enum CXChildVisitResult child(CXCursor cursor, CXCursor _, void *__) {
+            enum CXCursorKind kind = clang_getCursorKind(cursor);
+
+            if (kind == CXCursor_EnumConstantDecl && d->kind == CXCursor_EnumDecl) {
+                CXString s = clang_getCursorSpelling(cursor);
+                sym_t name = symtab_intern(c->symtab, clang_getCString(s));
+                clang_disposeString(s);
+                if (name == SYM_NONE || index_add(c, name, i) != 0) {
+                    ret = -1;
+                    return CXChildVisit_Break;
+                }
+
+            } else if (is_tag(kind) && !is_tag(d->kind) &&
+                    clang_isCursorDefinition(cursor)) {
+                /* In code like 'typedef struct foo {...} foo_t', Clang gives
+                 * us foo and foo_t as siblings, but only the text of foo_t
+                 * contains the definition of foo (see emit() in prune.c). So
+                 * each is needed whenever the other is.
+                 */
+                sym_t tag = tag_key(c, cursor);
+                if (tag == SYM_NONE || index_add(c, tag, i) != 0) {
+                    ret = -1;
+                    return CXChildVisit_Break;
+                }
+                decl_list_t *l = dict_get(c->index, tag);
+                for (size_t j = 0; j < l->sz; j++) {
+                    if (index_add(c, key, l->decls[j]) != 0) {
+                        ret = -1;
+                        return CXChildVisit_Break;
+                    }
+                }
+            }
+            return CXChildVisit_Continue;
+        }
+        clang_visitChildren(d->cursor, (CXCursorVisitor)child, NULL);
+
+        /* With 'int x, y;', Clang gives us x and y as separate declarations
+         * starting at the same place, and only the last of them is emitted
+         * (see emit() in prune.c). So, again, each needs the other.
+         */
+        if (i > 0 && c->keys[i - 1] != SYM_NONE &&
+                offset_of(clang_getRangeStart(d->extent)) ==
+                offset_of(clang_getRangeStart(c->decls[i - 1].extent))) {
+            if (index_add(c, key, i - 1) != 0 ||
+                    index_add(c, c->keys[i - 1], i) != 0)
+                return -1;
+        }
+    }
+    return ret;
+}
+
+bool *cfg_needed(cfg_t *c, const bitset_t *roots,
+        const bitset_t *blacklist) {
+    if (c->index == NULL && build_index(c) != 0)
+        return NULL;
+
+    bool *needed = calloc(c->decls_sz + 1, sizeof(*needed));
+    if (needed == NULL)
+        return NULL;
+
+    bitset_t *seen = bitset();
+    if (seen == NULL)
+        goto fail1;
+
+    /* Keys we have yet to expand. */
+    sym_t *pending = NULL;
+    size_t pending_sz = 0, pending_cap = 0;
+    bool ok = true;
+    void need(sym_t key) {
+        if (key == SYM_NONE || bitset_contains(seen, key))
+            return;
+        if (bitset_insert(seen, key) != 0) {
+            ok = false;
+            return;
+        }
+        if (pending_sz == pending_cap) {
+            size_t cap = pending_cap == 0 ? 256 : pending_cap * 2;
+            sym_t *p = realloc(pending, cap * sizeof(*p));
+            if (p == NULL) {
+                ok = false;
+                return;
+            }
+            pending = p;
+            pending_cap = cap;
+        }
+        pending[pending_sz++] = key;
+    }
+
+    enum CXChildVisitResult ref(CXCursor cursor, CXCursor _, void *__) {
+        enum CXCursorKind kind = clang_getCursorKind(cursor);
+        if (kind == CXCursor_TypeRef || kind == CXCursor_DeclRefExpr)
+            need(ref_key(c, clang_getCursorReferenced(cursor)));
+        return ok ? CXChildVisit_Recurse : CXChildVisit_Break;
+    }
+
+    /* Without bodies in the AST, look for references in their tokens. */
+    void ref_tokens(CXSourceRange range) {
+        CXToken *tokens;
+        unsigned int tokens_sz;
+        clang_tokenize(c->tu, range, &tokens, &tokens_sz);
+        const char *prefix = NULL;
+        for (unsigned int i = 0; i < tokens_sz && ok; i++) {
+            CXTokenKind kind = clang_getTokenKind(tokens[i]);
+            CXString s = clang_getTokenSpelling(c->tu, tokens[i]);
+            const char *text = clang_getCString(s);
+            if (kind == CXToken_Keyword) {
+                prefix = !strcmp(text, "struct") ? "struct " :
+                         !strcmp(text, "union") ? "union " :
+                         !strcmp(text, "enum") ? "enum " : NULL;
+            } else if (kind == CXToken_Identifier) {
+                char *tag = NULL;
+                if (prefix != NULL) {
+                    tag = malloc(strlen(prefix) + strlen(text) + 1);
+                    if (tag == NULL) {
+                        ok = false;
+                    } else {
+                        strcpy(tag, prefix);
+                        strcat(tag, text);
+                    }
+                }
+                sym_t key;
+                if (ok && symtab_lookup(c->symtab, tag == NULL ? text : tag,
+                        &key) && dict_contains(c->index, key))
+                    need(key);
+                free(tag);
+                prefix = NULL;
+            } else {
+                prefix = NULL;
+            }
+            clang_disposeString(s);
+        }
+        clang_disposeTokens(c->tu, tokens, tokens_sz);
+    }
+
+    /* Everything we cannot key is always emitted, so is a root along with
+     * whatever we were asked for.
+     */
+    bitset_foreach(roots, need);
+    for (size_t i = 0; i < c->decls_sz; i++) {
+        if (c->keys[i] == SYM_NONE &&
+                !bitset_contains(blacklist, c->decls[i].name)) {
+            needed[i] = true;
+            clang_visitChildren(c->decls[i].cursor, (CXCursorVisitor)ref, NULL);
+        }
+    }
+
+    while (ok && pending_sz > 0) {
+        sym_t key = pending[--pending_sz];
+        decl_list_t *l = dict_get(c->index, key);
+        if (l == NULL)
+            continue;
+
+        for (size_t j = 0; j < l->sz && ok; j++) {
+            size_t i = l->decls[j];
+            const cfg_decl_t *d = &c->decls[i];
+            if (needed[i] || bitset_contains(blacklist, d->name))
+                continue;
+            needed[i] = true;
+
+            need(c->keys[i]);
+            clang_visitChildren(d->cursor, (CXCursorVisitor)ref, NULL);
+            if (c->mode == CFG_TOKENS && d->kind == CXCursor_FunctionDecl &&
+                    d->definition) {
+                fn_t *f = dict_get(c->fns, d->name);
+                if (f != NULL)
+                    ref_tokens(f->body);
+            }
+        }
+    }
+
+    free(pending);
+    bitset_destroy(seen);
+    if (ok)
+        return needed;
+
+fail1: free(needed);
+    return NULL;
+}
+
 void cfg_destroy(cfg_t *c) {
-    dict_destroy(c);
+    if (c->index != NULL)
+        dict_destroy(c->index);
+    free(c->keys);
+    free(c->decls);
+    free(c->stack);
+    bitset_destroy(c->marked);
+    free(c->edges);
+    set_destroy(c->undefined);
+    dict_destroy(c->fns);
+    arena_destroy(c->arena);
+    free(c);
 }
@@ -15,34 +15,185 @@
  * translation unit.
  */
 
+#include "bitset.h"
 #include <clang-c/Index.h> /* -lclang */
 #include "dict.h"
+#include "set.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "symtab.h"
 
-typedef dict_t cfg_t;
+typedef struct cfg cfg_t;
 
-/* Initialise a representation of the CFG. Note that the CFG is initialised
- * lazily, so we won't actually traverse a particular function (and derive its
- * callees) until we actually need to.
+typedef enum {
+    /* Only derive a function's callees when a traversal first reaches it. */
+    CFG_LAZY,
+    /* Derive all call edges up front, in the same pass over the translation
+     * unit that collects the top-level declarations.
+     */
+    CFG_EAGER,
+    /* Like CFG_LAZY, but derive a function's callees from the tokens of its
+     * body rather than its AST. This is much cheaper than visiting every node
+     * of the body, and over-approximates: any identifier followed by '(' is a
+     * callee, as is any other mention of a function defined in the translation
+     * unit (i.e. taking its address). It is also the only option for
+     * translation units parsed with CXTranslationUnit_SkipFunctionBodies,
+     * which have no AST below the top-level declarations. The extent of each
+     * function definition is extended to cover its body if it was skipped.
+     */
+    CFG_TOKENS,
+} cfg_mode_t;
+
+/* Initialise a representation of the CFG. In lazy mode we won't actually
+ * traverse a particular function (and derive its callees) until we actually
+ * need to. In eager mode the whole translation unit is traversed exactly once.
+ * In either mode, the top-level declarations of the translation unit are
+ * recorded so callers need not traverse it again (see cfg_decls below).
+ *
+ * All names are interned into the given symbol table, which must outlive the
+ * CFG.
  *
  * Returns NULL on failure. */
-cfg_t *cfg(CXTranslationUnit tu);
+cfg_t *cfg(CXTranslationUnit tu, cfg_mode_t mode, symtab_t *symtab);
+
+/* Invoke a function on the name of every global variable definition in a CFG
+ * that is not static. Global variables are nodes of the CFG like functions,
+ * whose callees are the functions (and static variables) their initialisers
+ * refer to, so they can be passed to cfg_visit_callees as roots. Static
+ * variables (every declaration of which is a node, definition or not) are
+ * left out, as they are instead callees of whatever refers to them and so
+ * only reachable from roots that (transitively) need them. The exceptions are
+ * those referred to from outside any function or variable definition (e.g.
+ * from an enumerator or a typedef), which are always needed.
+ */
+void cfg_globals(cfg_t *c, void (*f)(sym_t name));
+
+/* Invoke a function on the name of every function and global variable
+ * definition in a CFG (counting any declaration of a static variable).
+ */
+void cfg_definitions(cfg_t *c, void (*f)(sym_t name));
+
+/* Count the function definitions in a CFG and the call edges found so far (in
+ * lazy mode, only functions that have been traversed have been scanned).
+ */
+void cfg_count(cfg_t *c, unsigned long *functions, unsigned long *edges);
+
+/* Forget which functions previous calls to cfg_visit_callees have traversed,
+ * so subsequent traversals start afresh.
+ */
+void cfg_reset(cfg_t *c);
+
+/* Initialise an empty CFG that is not associated with any translation unit,
+ * for merging others into (see cfg_merge below). Returns NULL on failure.
+ */
+cfg_t *cfg_global(symtab_t *symtab);
+
+/* Add the function definitions and call edges of one CFG to another, so that
+ * traversals of the destination follow calls across translation units.
+ * Definitions of the same name in several CFGs (e.g. static functions in
+ * different files) are conservatively merged into one, with the union of their
+ * callees. Top-level declarations are not merged. The source CFG is unaffected
+ * except that, if it is lazy, all of its functions are scanned.
+ *
+ * Returns non-zero on failure.
+ */
+int cfg_merge(cfg_t *dst, cfg_t *src);
+
+/* Write the function definitions and call edges of a CFG in a compact binary
+ * form, tagged with the given key. If the CFG is lazy, all of its functions are
+ * scanned first. Returns non-zero on failure.
+ */
+int cfg_serialise(cfg_t *c, FILE *f, const char *key);
+
+/* Fill in the call edges of a lazy CFG from data written by cfg_serialise, so
+ * its functions never need to be scanned. Fails if the data was tagged with a
+ * different key, was saved by a CFG that finds callees differently (from
+ * tokens rather than the AST, or vice versa) or does not describe exactly the
+ * functions of this CFG, in which case the CFG should be discarded. Returns non-zero on failure.
+ */
+int cfg_deserialise(cfg_t *c, const char *data, size_t size, const char *key);
 
 /* Destroy a CFG representation and deallocate associated resources. */
 void cfg_destroy(cfg_t *c);
 
+/* A top-level declaration of the translation unit. */
+typedef struct {
+    CXCursor cursor;
+    enum CXCursorKind kind;
+    sym_t name;
+    CXSourceRange extent;
+    bool definition;
+    bool internal;      /* a static function or global variable */
+} cfg_decl_t;
+
+/* Retrieve the top-level declarations of the translation unit, in source
+ * order. The returned table is owned by the CFG.
+ */
+const cfg_decl_t *cfg_decls(cfg_t *c, size_t *count);
+
+/* Determine which top-level declarations (see cfg_decls) are needed by a set
+ * of roots: the functions, variables, typedefs, structs, unions and enums the
+ * roots refer to, in their signatures, bodies, initialisers or definitions,
+ * and so on transitively. Roots are named as they would be in the source, so
+ * tags are named as, e.g., "struct foo". Blacklisted declarations are never
+ * needed, and declarations of anything else (e.g. a stray ';') always are.
+ *
+ * Returns a malloced array with one flag per declaration, or NULL on failure.
+ */
+bool *cfg_needed(cfg_t *c, const bitset_t *roots,
+    const bitset_t *blacklist);
+
+/* Find a shortest chain of calls (or references from initialisers) leading
+ * from any of a set of roots to a given function or variable, scanning
+ * functions for their callees as necessary. On success, *chain is a malloced
+ * array of the chain's symbols, starting with a root and ending with the
+ * target. Returns 0 on success, 1 if the target is not reachable from any
+ * root, or -1 on failure.
+ */
+int cfg_chain(cfg_t *c, const bitset_t *roots, sym_t target, sym_t **chain,
+    size_t *chain_sz);
+
+typedef enum {
+    CFG_DOT,    /* Graphviz */
+    CFG_JSON,
+} cfg_format_t;
+
+/* Write the function and global variable definitions of a CFG, their callees
+ * and the callees that have no definition, scanning functions as necessary.
+ * If retained is non-NULL, definitions that are members of it are marked as
+ * such. Returns non-zero on failure.
+ */
+int cfg_dump(cfg_t *c, FILE *f, cfg_format_t format, const bitset_t *retained);
+
 /* Visitor used when visiting CFG nodes below. */
-typedef enum CXChildVisitResult (*cfg_visitor_t)(const char *callee,
-    const char *caller, void *data);
+typedef enum CXChildVisitResult (*cfg_visitor_t)(sym_t callee, sym_t caller,
+    void *data);
 
-/* Recursively visit all callees of a given function. user-provided visitor
+/* Visitor invoked when a call edge leads back to a function that is still
+ * being traversed (i.e. direct or mutual recursion).
+ */
+typedef void (*cfg_cycle_visitor_t)(sym_t callee, sym_t caller, void *data);
+
+/* Recursively visit all callees of a given function or global variable. Any
+ * reference to a function counts as a call, including taking its address (so
+ * it may be called through a pointer). user-provided visitor
  * function is invoked once per callee, with the caller function as the second
  * parameter (see cfg_visitor_t above). The visitor is invoked once per
- * undefined function with NULL as the callee function to give the user an
+ * undefined function with SYM_NONE as the callee function to give the user an
  * opportunity to detect and handle this.
  *
+ * Traversal is memoised in the CFG itself: a function is only ever entered
+ * once, no matter how many callers or previous calls to this function reached
+ * it. Hence visiting the callees of several roots in sequence costs time
+ * linear in the number of call edges reachable from all of them. Edges that
+ * close a cycle are not followed, but are reported to on_cycle if it is
+ * non-NULL. The traversal uses an explicit stack, so deep call chains do not
+ * consume C stack.
+ *
  * Returns non-zero on failure.
  */
-int cfg_visit_callees(cfg_t *c, const char *name, cfg_visitor_t visitor,
-    void *data);
+int cfg_visit_callees(cfg_t *c, sym_t name, cfg_visitor_t visitor,
+    cfg_cycle_visitor_t on_cycle, void *data);
 
 #endif
@@ -13,21 +13,35 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include "symtab.h"
 
 dict_t *dict(void (*value_destroyer)(void *value)) {
-    return g_hash_table_new_full(g_str_hash, g_str_equal, NULL, value_destroyer);
+    return g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+        value_destroyer);
 }
 
-void dict_set(dict_t *d, const char *key, void *value) {
-    g_hash_table_insert(d, (gpointer)key, value);
+void dict_set(dict_t *d, sym_t key, void *value) {
+    g_hash_table_insert(d, GUINT_TO_POINTER(key), value);
 }
 
-void *dict_get(dict_t *d, const char *key) {
-    return g_hash_table_lookup(d, key);
+void *dict_get(dict_t *d, sym_t key) {
+    return g_hash_table_lookup(d, GUINT_TO_POINTER(key));
 }
 
-bool dict_contains(dict_t *d, const char *key) {
-    return g_hash_table_contains(d, key);
+bool dict_contains(dict_t *d, sym_t key) {
+    return g_hash_table_contains(d, GUINT_TO_POINTER(key));
+}
+
+unsigned int dict_size(dict_t *d) {
+    return g_hash_table_size(d);
+}
+
+void dict_foreach(dict_t *d, void (*f)(sym_t key, void *value)) {
+    void f_wrapper(void *key, void *value,
+            void *user_data __attribute__((unused))) {
+        f(GPOINTER_TO_UINT(key), value);
+    }
+    g_hash_table_foreach(d, f_wrapper, NULL);
 }
 
 void dict_destroy(dict_t *d) {
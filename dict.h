@@ -11,17 +11,20 @@
 #ifndef _DICT_H_
 #define _DICT_H_
 
-/* Implementation of a dictionary. */
+/* Implementation of a dictionary keyed by symbols (see symtab.h). */
 
 #include <glib.h>
 #include <stdbool.h>
+#include "symtab.h"
 
 typedef GHashTable dict_t;
 
 dict_t *dict(void (*value_destroyer)(void *value));
-void dict_set(dict_t *d, const char *key, void *value);
-void *dict_get(dict_t *d, const char *key);
-bool dict_contains(dict_t *d, const char *key);
+void dict_set(dict_t *d, sym_t key, void *value);
+void *dict_get(dict_t *d, sym_t key);
+bool dict_contains(dict_t *d, sym_t key);
+unsigned int dict_size(dict_t *d);
+void dict_foreach(dict_t *d, void (*f)(sym_t key, void *value));
 void dict_destroy(dict_t *d);
 
 #endif
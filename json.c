@@ -0,0 +1,333 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#include "buf.h"
+#include "json.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Nesting deeper than this is surely a mistake, and would otherwise let a
+ * malicious document exhaust the stack.
+ */
+#define MAX_DEPTH 256
+
+typedef struct {
+    const char *data;
+    size_t size;
+    size_t pos;
+} parser_t;
+
+static void skip_space(parser_t *p) {
+    while (p->pos < p->size && strchr(" \t\r\n", p->data[p->pos]) != NULL &&
+            p->data[p->pos] != '\0')
+        p->pos++;
+}
+
+/* Consume a literal string if it is next. */
+static bool consume(parser_t *p, const char *literal) {
+    size_t len = strlen(literal);
+    if (p->size - p->pos < len || memcmp(p->data + p->pos, literal, len))
+        return false;
+    p->pos += len;
+    return true;
+}
+
+/* Read four hex digits. Returns -1 if they are not. */
+static long hex4(parser_t *p) {
+    if (p->size - p->pos < 4)
+        return -1;
+    long value = 0;
+    for (unsigned int i = 0; i < 4; i++) {
+        char c = p->data[p->pos++];
+        value <<= 4;
+        if (c >= '0' && c <= '9')
+            value |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            value |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            value |= c - 'A' + 10;
+        else
+            return -1;
+    }
+    return value;
+}
+
+/* Append a code point as UTF-8. Returns non-zero on failure. */
+static int put_utf8(buf_t *b, uint32_t c) {
+    if (c < 0x80)
+        return buf_putc(b, (char)c);
+    if (c < 0x800)
+        return buf_putc(b, (char)(0xc0 | (c >> 6))) |
+            buf_putc(b, (char)(0x80 | (c & 0x3f)));
+    if (c < 0x10000)
+        return buf_putc(b, (char)(0xe0 | (c >> 12))) |
+            buf_putc(b, (char)(0x80 | ((c >> 6) & 0x3f))) |
+            buf_putc(b, (char)(0x80 | (c & 0x3f)));
+    return buf_putc(b, (char)(0xf0 | (c >> 18))) |
+        buf_putc(b, (char)(0x80 | ((c >> 12) & 0x3f))) |
+        buf_putc(b, (char)(0x80 | ((c >> 6) & 0x3f))) |
+        buf_putc(b, (char)(0x80 | (c & 0x3f)));
+}
+
+/* Parse a string, the opening quote of which is next. Returns a malloced
+ * copy, or NULL on failure.
+ */
+static char *parse_string(parser_t *p) {
+    buf_t *b = buf(0);
+    if (b == NULL)
+        return NULL;
+    p->pos++;
+
+    while (p->pos < p->size) {
+        unsigned char c = (unsigned char)p->data[p->pos];
+        if (c == '"') {
+            p->pos++;
+            if (buf_putc(b, '\0') != 0)
+                break;
+            char *s = b->data;
+            free(b);
+            return s;
+        }
+        if (c < 0x20)
+            break;
+        if (c != '\\') {
+            if (buf_putc(b, (char)c) != 0)
+                break;
+            p->pos++;
+            continue;
+        }
+
+        if (++p->pos == p->size)
+            break;
+        char e = p->data[p->pos++];
+        const char *escapes = "\"\"\\\\//b\bf\fn\nr\rt\t";
+        const char *match = NULL;
+        for (const char *q = escapes; *q != '\0'; q += 2) {
+            if (*q == e) {
+                match = q + 1;
+                break;
+            }
+        }
+        if (match != NULL) {
+            if (buf_putc(b, *match) != 0)
+                break;
+            continue;
+        }
+        if (e != 'u')
+            break;
+
+        /* A UTF-16 code unit, which may be the first of a surrogate pair. */
+        long u = hex4(p);
+        if (u < 0)
+            break;
+        if (u >= 0xd800 && u < 0xdc00) {
+            if (!consume(p, "\\u"))
+                break;
+            long low = hex4(p);
+            if (low < 0xdc00 || low >= 0xe000)
+                break;
+            u = 0x10000 + ((u - 0xd800) << 10) + (low - 0xdc00);
+        } else if (u >= 0xdc00 && u < 0xe000) {
+            break;
+        }
+        if (u == 0 || put_utf8(b, (uint32_t)u) != 0)
+            /* An embedded NUL would silently truncate the string. */
+            break;
+    }
+
+    buf_destroy(b);
+    return NULL;
+}
+
+/* Skip a run of decimal digits. Returns false if there are none. */
+static bool digits(parser_t *p) {
+    size_t from = p->pos;
+    while (p->pos < p->size && p->data[p->pos] >= '0' &&
+            p->data[p->pos] <= '9')
+        p->pos++;
+    return p->pos > from;
+}
+
+/* Parse a number, according to JSON's (stricter than strtod's) grammar. */
+static bool parse_number(parser_t *p, double *value) {
+    size_t start = p->pos;
+    bool ok = true;
+
+    consume(p, "-");
+    if (consume(p, "0")) {
+        /* No leading zeroes. */
+    } else {
+        ok &= digits(p);
+    }
+    if (ok && consume(p, "."))
+        ok &= digits(p);
+    if (ok && (consume(p, "e") || consume(p, "E"))) {
+        if (!consume(p, "+"))
+            consume(p, "-");
+        ok &= digits(p);
+    }
+    if (!ok)
+        return false;
+
+    char *copy = strndup(p->data + start, p->pos - start);
+    if (copy == NULL)
+        return false;
+    *value = strtod(copy, NULL);
+    free(copy);
+    return true;
+}
+
+static json_t *parse_value(parser_t *p, unsigned int depth);
+
+/* Parse the members of an array or object, the opening bracket of which is
+ * next, into j. Returns non-zero on failure.
+ */
+static int parse_members(parser_t *p, json_t *j, unsigned int depth) {
+    char close = j->type == JSON_ARRAY ? ']' : '}';
+    size_t cap = 0;
+    p->pos++;
+
+    skip_space(p);
+    if (p->pos < p->size && p->data[p->pos] == close) {
+        p->pos++;
+        return 0;
+    }
+
+    while (true) {
+        if (j->items_sz == cap) {
+            cap = cap == 0 ? 8 : cap * 2;
+            json_t **items = realloc(j->items, cap * sizeof(*items));
+            if (items == NULL)
+                return -1;
+            j->items = items;
+            if (j->type == JSON_OBJECT) {
+                char **keys = realloc(j->keys, cap * sizeof(*keys));
+                if (keys == NULL)
+                    return -1;
+                j->keys = keys;
+            }
+        }
+
+        char *key = NULL;
+        if (j->type == JSON_OBJECT) {
+            skip_space(p);
+            if (p->pos == p->size || p->data[p->pos] != '"')
+                return -1;
+            key = parse_string(p);
+            if (key == NULL)
+                return -1;
+            skip_space(p);
+            if (!consume(p, ":")) {
+                free(key);
+                return -1;
+            }
+        }
+
+        json_t *item = parse_value(p, depth + 1);
+        if (item == NULL) {
+            free(key);
+            return -1;
+        }
+        if (j->type == JSON_OBJECT)
+            j->keys[j->items_sz] = key;
+        j->items[j->items_sz++] = item;
+
+        skip_space(p);
+        if (consume(p, ","))
+            continue;
+        if (p->pos < p->size && p->data[p->pos] == close) {
+            p->pos++;
+            return 0;
+        }
+        return -1;
+    }
+}
+
+static json_t *parse_value(parser_t *p, unsigned int depth) {
+    if (depth > MAX_DEPTH)
+        return NULL;
+
+    skip_space(p);
+    if (p->pos == p->size)
+        return NULL;
+
+    json_t *j = calloc(1, sizeof(*j));
+    if (j == NULL)
+        return NULL;
+
+    bool ok = true;
+    char c = p->data[p->pos];
+    if (c == '{' || c == '[') {
+        j->type = c == '{' ? JSON_OBJECT : JSON_ARRAY;
+        ok = parse_members(p, j, depth) == 0;
+    } else if (c == '"') {
+        j->type = JSON_STRING;
+        j->string = parse_string(p);
+        ok = j->string != NULL;
+    } else if (consume(p, "true")) {
+        j->type = JSON_BOOL;
+        j->boolean = true;
+    } else if (consume(p, "false")) {
+        j->type = JSON_BOOL;
+    } else if (consume(p, "null")) {
+        j->type = JSON_NULL;
+    } else {
+        j->type = JSON_NUMBER;
+        ok = parse_number(p, &j->number);
+    }
+
+    if (!ok) {
+        json_destroy(j);
+        return NULL;
+    }
+    return j;
+}
+
+json_t *json_parse(const char *data, size_t size, size_t *error) {
+    parser_t p = {
+        .data = data,
+        .size = size,
+    };
+    json_t *j = parse_value(&p, 0);
+    if (j != NULL) {
+        /* Nothing may follow the document. */
+        skip_space(&p);
+        if (p.pos == p.size)
+            return j;
+        json_destroy(j);
+    }
+    *error = p.pos;
+    return NULL;
+}
+
+void json_destroy(json_t *j) {
+    for (size_t i = 0; i < j->items_sz; i++) {
+        json_destroy(j->items[i]);
+        if (j->keys != NULL)
+            free(j->keys[i]);
+    }
+    free(j->items);
+    free(j->keys);
+    free(j->string);
+    free(j);
+}
+
+const json_t *json_get(const json_t *object, const char *key) {
+    if (object->type != JSON_OBJECT)
+        return NULL;
+    for (size_t i = object->items_sz; i > 0; i--) {
+        if (!strcmp(object->keys[i - 1], key))
+            return object->items[i - 1];
+    }
+    return NULL;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#ifndef _JSON_H_
+#define _JSON_H_
+
+/* A small JSON parser, for reading job manifests. Documents are parsed into a
+ * tree in one go; nothing is streamed.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum {
+    JSON_NULL,
+    JSON_BOOL,
+    JSON_NUMBER,
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OBJECT,
+} json_type_t;
+
+typedef struct json {
+    json_type_t type;
+    bool boolean;
+    double number;
+    char *string;           /* NUL-terminated, UTF-8 */
+    struct json **items;    /* members of an array or values of an object */
+    char **keys;            /* keys of an object, parallel to items */
+    size_t items_sz;
+} json_t;
+
+/* Parse a JSON document. Returns NULL on failure, with the offset of the
+ * problem in *error (or size, if the document ended early).
+ */
+json_t *json_parse(const char *data, size_t size, size_t *error);
+
+void json_destroy(json_t *j);
+
+/* The value of a member of an object, or NULL if it has no such member (or is
+ * not an object). If a key appears more than once, the last value counts.
+ */
+const json_t *json_get(const json_t *object, const char *key);
+
+#endif
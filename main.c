@@ -9,230 +9,364 @@
  */
 
 #include <assert.h>
+#include "bitset.h"
+#include "buf.h"
 #include "cfg.h"
+#include <clang-c/CXCompilationDatabase.h>
 #include <clang-c/Index.h> /* -lclang */
+#include <ctype.h>
+#include "dict.h"
 #include <errno.h>
 #include <getopt.h>
+#include "json.h"
+#include <limits.h>
+#include "prune.h"
+#include <pthread.h>
 #include "set.h"
+#include "sink.h"
+#include "stats.h"
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include "symtab.h"
+#include <unistd.h>
 
-//#define DEBUG 1
-
-/* We want to implement a rewriter (or source-to-source translator). The
- * standard way of doing this would be to sub-class RecursiveASTVisitor and go
- * from there. After several attempts I gave up on getting either of the Clang
- * C++ or Python bindings to compile and link and resorted to the below in C.
- */
+/* A job from a --jobs manifest. */
+typedef struct {
+    const json_t *spec;     /* its entry in the manifest */
+    const char *output;     /* where it asked for output to go, or NULL */
+    prune_t *prune;         /* its own context, derived from the command
+                             * line's */
+} task_t;
 
-/* Determine whether a given cursor is in our list of entities to never emit. */
-static bool is_blacklisted(set_t *blacklist, CXCursor cursor) {
-    CXString s = clang_getCursorSpelling(cursor);
-    const char *name = clang_getCString(s);
-    bool blacklisted = set_contains(blacklist, name);
-    clang_disposeString(s);
-    return blacklisted;
-}
+typedef struct {
+    const char **inputs;
+    size_t inputs_sz;
+    const char **outputs;   /* either one per input, or a single template */
+    size_t outputs_sz;
+    unsigned int threads;
+    prune_t *prune;         /* everything that affects the output */
+    const char *build_pch;  /* header to precompile first, or NULL */
+    const char **why;       /* symbols to explain the retention of */
+    size_t why_sz;
+    const char *dump_graph; /* where to write call graphs, or NULL */
+    const char *manifest;   /* where to read jobs from, or NULL */
+    task_t *tasks;          /* one per input, if read from a manifest */
+    bool whole_program;
+    bool serve;
+    bool stats;
+} options_t;
 
-/* Dump a given cursor to the passed stream. */
-static void emit(FILE* stream, CXTranslationUnit tu, CXCursor cursor, set_t *attribs) {
-    /* Transform the cursor into a list of text tokens. */
-    CXSourceRange range = clang_getCursorExtent(cursor);
-    CXToken *tokens;
-    unsigned int tokens_sz;
-    clang_tokenize(tu, range, &tokens, &tokens_sz);
+/* Apply an option to its argument or, if the argument is @file, to each line
+ * of the file in turn, ignoring surrounding white space, blank lines and lines
+ * starting with '#'. Returns non-zero on failure.
+ */
+static int each_argument(char *arg, int (*apply)(char *value)) {
+    if (arg[0] != '@')
+        return apply(arg);
 
-    /* Bail out early if possible to reduce complexity in the follow on logic.
-     */
-    if (tokens_sz == 0) {
-        clang_disposeTokens(tu, tokens, tokens_sz);
-        return;
+    FILE *f = fopen(arg + 1, "r");
+    if (f == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", arg + 1, strerror(errno));
+        return -1;
     }
 
-    /* Now time to deal with Clang's quirks. */
-
-    /* Grab the last token. */
-    CXString cxlast = clang_getTokenSpelling(tu, tokens[tokens_sz - 1]);
-    const char *last = clang_getCString(cxlast);
+    int ret = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    while (ret == 0 && (len = getline(&line, &line_cap, f)) != -1) {
+        while (len > 0 && isspace((unsigned char)line[len - 1]))
+            line[--len] = '\0';
+        char *value = line;
+        while (isspace((unsigned char)*value))
+            value++;
+        if (*value != '\0' && *value != '#')
+            ret = apply(value);
+    }
+    if (ret == 0 && ferror(f)) {
+        fprintf(stderr, "failed to read %s\n", arg + 1);
+        ret = -1;
+    }
 
-    /* Grab the first token. */
-    CXString cxfirst = clang_getTokenSpelling(tu, tokens[0]);
-    const char *first = clang_getCString(cxfirst);
+    free(line);
+    fclose(f);
+    return ret;
+}
 
-    enum CXCursorKind kind = clang_getCursorKind(cursor);
+/* Determine absolute paths for the input files, which is how the compilation
+ * database knows them, or take every file in the database if none were given.
+ * Returns non-zero on failure.
+ */
+static int compile_command_inputs(options_t *o) {
+    CXCompileCommands cmds = NULL;
+    size_t cap = o->inputs_sz;
+    if (o->inputs_sz == 0) {
+        cmds = clang_CompilationDatabase_getAllCompileCommands(
+            o->prune->compile_commands);
+        cap = cmds == NULL ? 0 : clang_CompileCommands_getSize(cmds);
+    }
 
-#ifdef DEBUG
-    CXString cxname = clang_getCursorSpelling(cursor);
-    const char *name = clang_getCString(cxname);
-    CXString cxkind = clang_getTypeKindSpelling(kind);
-    const char *k = clang_getCString(cxkind);
-    fprintf(stderr, "Cursor %s of kind %s\n", name, k);
-    clang_disposeString(cxkind);
-    clang_disposeString(cxname);
-#endif
+    const char **inputs = calloc(cap, sizeof(*inputs));
+    if (cap > 0 && inputs == NULL)
+        goto fail1;
+    size_t inputs_sz = 0;
 
-    switch (kind) {
+    /* Commands can appear more than once in the database for the same file
+     * (e.g. when it is built with different flags), but we only want to prune
+     * each file once. Inputs we were given are kept as they are, as their
+     * positions match those of their outputs and --jobs settings, and the same
+     * file may legitimately be pruned under different settings.
+     */
+    set_t *seen = set();
+    if (seen == NULL)
+        goto fail2;
 
-        /* XXX: If the cursor is an empty `;`, its extent covers the
-         * (unrelated) following token as well. Libclang bug?
-         * We could potentially just return here, but for now we will emit
-         * the ';' anyway.  Decreasing the tokens_sz prevents us from also
-         * emitting the unrelated following token.
-         */
-        case CXCursor_UnexposedDecl:
-            if (!strcmp(first, ";")) {
-                tokens_sz--;
+    for (size_t i = 0; i < cap; i++) {
+        char *path;
+        if (cmds == NULL) {
+            /* Not being able to resolve a path is left for loading to
+             * report.
+             */
+            path = realpath(o->inputs[i], NULL);
+            if (path == NULL)
+                path = strdup(o->inputs[i]);
+        } else {
+            CXCompileCommand cmd = clang_CompileCommands_getCommand(cmds, i);
+            CXString dir = clang_CompileCommand_getDirectory(cmd);
+            CXString file = clang_CompileCommand_getFilename(cmd);
+            const char *d = clang_getCString(dir);
+            const char *f = clang_getCString(file);
+            path = malloc(strlen(d) + strlen(f) + 2);
+            if (path != NULL) {
+                if (f[0] == '/')
+                    strcpy(path, f);
+                else
+                    sprintf(path, "%s/%s", d, f);
             }
-            break;
+            clang_disposeString(file);
+            clang_disposeString(dir);
+        }
+        if (path == NULL)
+            goto fail3;
 
-        /* XXX: If the cursor is a function definition, its extent covers the
-         * (unrelated) following token as well. Libclang bug? An exception is
-         * that a function appearing at the end of the translation unit will not
-         * have an extra appended token. To cope with this, assume we never want to strip
-         * closing braces.
-         */
-        case CXCursor_FunctionDecl:
-            if (clang_isCursorDefinition(cursor) && strcmp(last, "}"))
-                tokens_sz--;
-            break;
+        sym_t sym = symtab_intern(o->prune->symtab, path);
+        if (sym == SYM_NONE) {
+            free(path);
+            goto fail3;
+        }
+        if (cmds != NULL && set_contains(seen, sym)) {
+            free(path);
+            continue;
+        }
+        set_insert(seen, sym);
+        inputs[inputs_sz++] = path;
+    }
 
-        /* XXX: In code like 'typedef struct foo {...} foo_t', Clang considers
-         * foo and foo_t siblings. We end up visiting foo, then foo_t. In my
-         * mind, foo is a child of foo_t, but maybe Clang's outlook makes more
-         * sense from a scoping point of view. Either way, it helpfully covers
-         * an extra token in the foo cursor, so we can play the same trick as
-         * above to elide the (excess) struct definition.
-         */
-        case CXCursor_StructDecl:
-        case CXCursor_UnionDecl:
-        case CXCursor_EnumDecl:
-            if (strcmp(last, ";") && strcmp(last, "}")) {
-                clang_disposeString(cxlast);
-                clang_disposeString(cxfirst);
-                clang_disposeTokens(tu, tokens, tokens_sz);
-                return;
-            }
-            break;
+    set_destroy(seen);
+    if (cmds != NULL)
+        clang_CompileCommands_dispose(cmds);
+    o->inputs = inputs;
+    o->inputs_sz = inputs_sz;
+    return 0;
 
-        /* XXX: When multiple variables are declared in a single statement:
-         *  int x, y;
-         * the declaration appears once per variable. Only the final instance
-         * is terminated with a semi-colon and only it is valid.
-         */
-        case CXCursor_TypedefDecl:
-        case CXCursor_VarDecl:
-            /* To add insult to injury, typedefed structs with trailing
-             * __attribute__s come out with nothing following the
-             * __attribute__. Why? Who knows. In this case we actually *do*
-             * want to emit them. Probably. Of course this logic breaks down in
-             * the case of code like:
-             *  typedef struct f { int x; } y, z __attribute__(...);
-             * but I don't easily see how to resolve situations like this.
-             */
-            if (!strcmp(last, "__attribute__"))
-                break;
-            if (strcmp(last, ";")) {
-                clang_disposeString(cxlast);
-                clang_disposeString(cxfirst);
-                clang_disposeTokens(tu, tokens, tokens_sz);
-                return;
-            }
+fail3: set_destroy(seen);
+fail2: for (size_t i = 0; i < inputs_sz; i++)
+        free((char*)inputs[i]);
+    free(inputs);
+fail1: if (cmds != NULL)
+        clang_CompileCommands_dispose(cmds);
+    return -1;
+}
 
-        default: /* shut -Wswitch warnings up */
-            break;
+/* Read the jobs of a --jobs manifest, which is a JSON array of objects. Each
+ * names an "input" and optionally its "output", and may give arrays of
+ * strings to "keep", "blacklist", annotate with ("attributes", each as
+ * symbol:attrib) and pass to Clang ("args"), which apply to that job on top of
+ * the command line's. Returns non-zero on failure.
+ */
+static int read_manifest(options_t *o) {
+    source_t *src = source(o->manifest);
+    if (src == NULL) {
+        fprintf(stderr, "%s: failed to read manifest: %s\n", o->manifest,
+            strerror(errno));
+        return -1;
+    }
+    size_t error;
+    json_t *jobs = json_parse(src->data, src->size, &error);
+    source_destroy(src);
+    if (jobs == NULL) {
+        fprintf(stderr, "%s: invalid JSON at offset %zu\n", o->manifest, error);
+        return -1;
     }
 
-    clang_disposeString(cxlast);
-    clang_disposeString(cxfirst);
-
-    /* Dump all the tokens, not trying to preserve white space. */
-    for (unsigned int i = 0; i < tokens_sz; i++) {
-        CXString s = clang_getTokenSpelling(tu, tokens[i]);
-        const char *token = clang_getCString(s);
-        if (i == tokens_sz - 1 && attribs != NULL) {
-            /* Precede the last token with any extra attributes. */
-            void print_attribute(const char *attrib) {
-                fprintf(stream, "__attribute__((%s))\n", attrib);
-            }
-            set_foreach(attribs, (void(*)(void*))print_attribute);
-        }
-        if (i == tokens_sz - 1 &&
-                (kind == CXCursor_TypedefDecl || kind == CXCursor_VarDecl) &&
-                !strcmp(token, "__attribute__"))
-            /* XXX: Yet more hackery. Libclang misparses a trailing attribute
-             * on a typedef. This should appear in the AST as an UnexposedDecl,
-             * but for whatever reason it doesn't. No idea from whence this
-             * behaviour stems as Clang itself just removes the attribute from
-             * the AST altogether entirely.
-             */
-            fprintf(stream, "; ");
-        else
-            fprintf(stream, "%s\n", token);
-        clang_disposeString(s);
+    if (jobs->type != JSON_ARRAY || jobs->items_sz == 0) {
+        fprintf(stderr, "%s: expected a non-empty array of jobs\n",
+            o->manifest);
+        goto fail1;
     }
-    clang_disposeTokens(tu, tokens, tokens_sz);
-}
 
-/* State data that we'll pass around while visiting the AST. */
-typedef struct {
-    set_t *keep;
-    set_t *blacklist;
-    dict_t *extra_attributes;
-    CXTranslationUnit *tu;
-    FILE *out;
-} state_t;
+    const char **inputs = calloc(jobs->items_sz, sizeof(*inputs));
+    if (inputs == NULL)
+        goto fail1;
+    task_t *tasks = calloc(jobs->items_sz, sizeof(*tasks));
+    if (tasks == NULL)
+        goto fail2;
 
-/* Visit a node in the AST. */
-enum CXChildVisitResult visitor(CXCursor cursor, CXCursor _, state_t *state) {
+    /* Whether a field is a string, or an array of them, or absent. */
+    bool is_string(const json_t *j) {
+        return j == NULL || j->type == JSON_STRING;
+    }
+    bool is_strings(const json_t *j) {
+        if (j == NULL)
+            return true;
+        if (j->type != JSON_ARRAY)
+            return false;
+        for (size_t i = 0; i < j->items_sz; i++) {
+            if (j->items[i]->type != JSON_STRING)
+                return false;
+        }
+        return true;
+    }
 
-    CXString s = clang_getCursorSpelling(cursor);
-    const char *name = clang_getCString(s);
+    static const char *const fields[] = { "input", "output", "keep",
+        "blacklist", "attributes", "args" };
+    for (size_t i = 0; i < jobs->items_sz; i++) {
+        const json_t *spec = jobs->items[i];
+        bool ok = spec->type == JSON_OBJECT;
+        for (size_t j = 0; ok && j < spec->items_sz; j++) {
+            ok = false;
+            for (size_t k = 0; k < sizeof(fields) / sizeof(fields[0]); k++)
+                ok |= !strcmp(spec->keys[j], fields[k]);
+        }
 
-    bool retain = true;
+        const json_t *input = ok ? json_get(spec, "input") : NULL;
+        const json_t *output = ok ? json_get(spec, "output") : NULL;
+        if (input == NULL || input->type != JSON_STRING || !is_string(output) ||
+                !is_strings(json_get(spec, "keep")) ||
+                !is_strings(json_get(spec, "blacklist")) ||
+                !is_strings(json_get(spec, "attributes")) ||
+                !is_strings(json_get(spec, "args"))) {
+            fprintf(stderr, "%s: job %zu is malformed\n", o->manifest, i);
+            goto fail3;
+        }
 
-    if (clang_getCursorKind(cursor) == CXCursor_FunctionDecl) {
-        /* Determine whether the function was one of those the user requested
-         * to keep. */
-        retain = set_contains(state->keep, name);
+        inputs[i] = input->string;
+        tasks[i].spec = spec;
+        tasks[i].output = output == NULL ? NULL : output->string;
     }
 
-    /* Get any extra attributes we need to apply to this symbol. */
-    set_t *attribs = dict_get(state->extra_attributes, name);
-
-    /* Don't need the symbol name any more. */
-    clang_disposeString(s);
+    /* The manifest's strings are used for the rest of the run. */
+    o->inputs = inputs;
+    o->inputs_sz = jobs->items_sz;
+    o->tasks = tasks;
+    return 0;
 
-    if (!retain)
-        return CXChildVisit_Continue;
+fail3: free(tasks);
+fail2: free(inputs);
+fail1: json_destroy(jobs);
+    return -1;
+}
 
-    if (is_blacklisted(state->blacklist, cursor))
-        return CXChildVisit_Continue;
+/* Give each job of a manifest its own context, copied from the command line's
+ * once its settings are final. Returns non-zero on failure.
+ */
+static int job_contexts(options_t *o) {
+    for (size_t i = 0; i < o->inputs_sz; i++) {
+        task_t *t = &o->tasks[i];
+        t->prune = prune_copy(o->prune);
+        if (t->prune == NULL) {
+            fprintf(stderr, "%s: failed to allocate memory\n", o->inputs[i]);
+            return -1;
+        }
 
-    /* If we reached here, the current cursor is one we do want in the output.
-     */
-    emit(state->out, *state->tu, cursor, attribs);
+        bool ok = true;
+        void each(const char *field, int (*apply)(char *value)) {
+            const json_t *values = json_get(t->spec, field);
+            for (size_t j = 0; ok && values != NULL && j < values->items_sz;
+                    j++) {
+                if (apply(values->items[j]->string) != 0) {
+                    fprintf(stderr, "%s: illegal %s entry %s in %s\n",
+                        o->inputs[i], field, values->items[j]->string,
+                        o->manifest);
+                    ok = false;
+                }
+            }
+        }
+        int keep(char *value) {
+            return prune_keep(t->prune, value);
+        }
+        int blacklist(char *value) {
+            return prune_blacklist(t->prune, value);
+        }
+        int add_attribute(char *value) {
+            char *symbol = strdup(value);
+            if (symbol == NULL)
+                return -1;
+            int ret = -1;
+            char *attrib = strstr(symbol, ":");
+            if (attrib != NULL) {
+                *attrib++ = '\0';
+                ret = prune_add_attribute(t->prune, symbol, attrib);
+            }
+            free(symbol);
+            return ret;
+        }
+        each("keep", keep);
+        each("blacklist", blacklist);
+        each("attributes", add_attribute);
+        if (!ok)
+            return -1;
 
-    /* Never recurse (in the AST). We're only visiting top-level nodes. */
-    return CXChildVisit_Continue;
+        /* A job's own Clang arguments follow the command line's. */
+        const json_t *args = json_get(t->spec, "args");
+        if (args != NULL && args->items_sz > 0) {
+            size_t args_sz = o->prune->args_sz + args->items_sz;
+            const char **a = calloc(args_sz, sizeof(*a));
+            if (a == NULL) {
+                fprintf(stderr, "%s: failed to allocate memory\n",
+                    o->inputs[i]);
+                return -1;
+            }
+            for (size_t j = 0; j < o->prune->args_sz; j++)
+                a[j] = o->prune->args[j];
+            for (size_t j = 0; j < args->items_sz; j++)
+                a[o->prune->args_sz + j] = args->items[j]->string;
+            t->prune->args = a;
+            t->prune->args_sz = args_sz;
+        }
+    }
+    return 0;
 }
 
-typedef struct {
-    const char *input;
-    const char *output;
-    set_t *keep;
-    set_t *blacklist;
-    dict_t *extra_attributes;
-} options_t;
-
 static options_t *parse_args(int argc, char **argv) {
     const struct option opts[] = {
         {"add-attribute", required_argument, NULL, 'a'},
         {"blacklist", required_argument, NULL, 'b'},
+        {"build-pch", required_argument, NULL, 'H'},
+        {"cache-dir", required_argument, NULL, 'c'},
+        {"compact", no_argument, NULL, 'm'},
+        {"compile-commands", required_argument, NULL, 'C'},
+        {"dump-graph", required_argument, NULL, 'G'},
+        {"graph-cache", no_argument, NULL, 'g'},
         {"help", no_argument, NULL, '?'},
+        {"jobs", required_argument, NULL, 'J'},
         {"keep", required_argument, NULL, 'k'},
+        {"lazy", no_argument, NULL, 'l'},
         {"output", required_argument, NULL, 'o'},
+        {"pch", required_argument, NULL, 'P'},
+        {"prune-decls", no_argument, NULL, 'D'},
+        {"serve", no_argument, NULL, 's'},
+        {"skip-bodies", no_argument, NULL, 'B'},
+        {"stats", no_argument, NULL, 'S'},
+        {"threads", required_argument, NULL, 'j'},
+        {"token-scan", no_argument, NULL, 'T'},
+        {"verbatim", no_argument, NULL, 'V'},
+        {"whole-program", no_argument, NULL, 'w'},
+        {"why", required_argument, NULL, 'W'},
         {NULL, 0, NULL, 0},
     };
 
@@ -240,23 +374,35 @@ static options_t *parse_args(int argc, char **argv) {
     if (o == NULL)
         goto fail1;
 
-    /* defaults */
-    o->output = "/dev/stdout";
-    o->keep = set();
-    if (o->keep == NULL)
+    o->outputs = calloc(argc, sizeof(*o->outputs));
+    if (o->outputs == NULL)
         goto fail2;
 
-    o->blacklist = set();
-    if (o->blacklist == NULL)
+    o->why = calloc(argc, sizeof(*o->why));
+    if (o->why == NULL)
         goto fail3;
 
-    o->extra_attributes = dict((void(*)(void*))set_destroy);
-    if (o->extra_attributes == NULL)
+    o->prune = prune();
+    if (o->prune == NULL)
         goto fail4;
 
+    /* Everything after "--" is for Clang. We find it ourselves, because
+     * getopt would move any input files given before it to after it.
+     */
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--")) {
+            o->prune->args = (const char *const*)&argv[i + 1];
+            o->prune->args_sz = argc - i - 1;
+            argv[i] = NULL;
+            argc = i;
+            break;
+        }
+    }
+
     while (true) {
         int index = 0;
-        int c = getopt_long(argc, argv, "a:b:k:o:?", opts, &index);
+        int c = getopt_long(argc, argv, "a:b:Bc:C:DgG:H:j:J:k:lmo:P:sSTVwW:?", opts,
+            &index);
 
         if (c == -1)
             /* end of defined options */
@@ -264,46 +410,243 @@ static options_t *parse_args(int argc, char **argv) {
 
         switch (c) {
             case 'a':; /* --add-attribute */
-                char *attrib = strstr(optarg, ":");
-                if (attrib == NULL) {
-                    fprintf(stderr, "illegal argument %s to --add-attribute\n", optarg);
-                    goto fail4;
+                int add_attribute(char *value) {
+                    char *attrib = strstr(value, ":");
+                    if (attrib == NULL) {
+                        fprintf(stderr, "illegal argument %s to --add-attribute\n", value);
+                        return -1;
+                    }
+                    *attrib = '\0';/* NUL-terminate the symbol name */
+                    attrib++; /* move on to the attribute */
+                    return prune_add_attribute(o->prune, value, attrib);
                 }
-                *attrib = '\0';/* NUL-terminate the symbol name */
-                attrib++; /* move on to the attribute */
-                set_t *s = dict_get(o->extra_attributes, optarg);
-                if (s == NULL) {
-                    s = set();
-                    if (s == NULL)
-                        goto fail4;
-                    dict_set(o->extra_attributes, optarg, s);
+                if (each_argument(optarg, add_attribute) != 0)
+                    goto fail5;
+                break;
+
+            case 'b':; /* --blacklist */
+                int blacklist(char *value) {
+                    if (prune_blacklist(o->prune, value) == 0)
+                        return 0;
+                    fprintf(stderr, "illegal argument %s to --blacklist\n", value);
+                    return -1;
                 }
-                set_insert(s, attrib);
+                if (each_argument(optarg, blacklist) != 0)
+                    goto fail5;
+                break;
+
+            case 'B': /* --skip-bodies */
+                o->prune->skip_bodies = true;
+                break;
+
+            case 'c': /* --cache-dir */
+                o->prune->cache_dir = optarg;
+                break;
+
+            case 'C': /* --compile-commands */
+                if (prune_compile_commands(o->prune, optarg) != 0)
+                    goto fail5;
                 break;
 
-            case 'b': /* --blacklist */
-                set_insert(o->blacklist, optarg);
+            case 'D': /* --prune-decls */
+                o->prune->prune_decls = true;
                 break;
 
-            case 'k': /* --keep */
-                set_insert(o->keep, optarg);
+            case 'g': /* --graph-cache */
+                o->prune->graph_cache = true;
+                break;
+
+            case 'G': /* --dump-graph */
+                o->dump_graph = optarg;
+                break;
+
+            case 'H': /* --build-pch */
+                o->build_pch = optarg;
+                break;
+
+            case 'j':; /* --threads */
+                char *end;
+                unsigned long threads = strtoul(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || threads == 0 ||
+                        threads > UINT_MAX) {
+                    fprintf(stderr, "illegal argument %s to --threads\n", optarg);
+                    goto fail5;
+                }
+                o->threads = (unsigned int)threads;
+                break;
+
+            case 'J': /* --jobs */
+                o->manifest = optarg;
+                break;
+
+            case 'k':; /* --keep */
+                int keep(char *value) {
+                    if (prune_keep(o->prune, value) == 0)
+                        return 0;
+                    fprintf(stderr, "illegal argument %s to --keep\n", value);
+                    return -1;
+                }
+                if (each_argument(optarg, keep) != 0)
+                    goto fail5;
+                break;
+
+            case 'l': /* --lazy */
+                o->prune->cfg_mode = CFG_LAZY;
+                break;
+
+            case 'm': /* --compact */
+                o->prune->compact = true;
                 break;
 
             case 'o': /* --output */
-                o->output = optarg;
+                o->outputs[o->outputs_sz++] = optarg;
+                break;
+
+            case 'P': /* --pch */
+                o->prune->pch = optarg;
+                break;
+
+            case 's': /* --serve */
+                o->serve = true;
+                break;
+
+            case 'S': /* --stats */
+                o->stats = true;
+                break;
+
+            case 'T': /* --token-scan */
+                o->prune->cfg_mode = CFG_TOKENS;
+                break;
+
+            case 'V': /* --verbatim */
+                o->prune->verbatim = true;
+                break;
+
+            case 'w': /* --whole-program */
+                o->whole_program = true;
+                break;
+
+            case 'W': /* --why */
+                o->why[o->why_sz++] = optarg;
                 break;
 
             case '?': /* --help */
-                printf("Usage: %s options... input_file\n"
-                       "Trims a C file by discarding unwanted functions.\n"
+                printf("Usage: %s options... input_file... [-- clang_args...]\n"
+                       "Trims C files by discarding unwanted functions.\n"
                        "\n"
                        " Options:\n"
                        "  --add-attribute symbol:attrib\n"
                        "  -a symbol:attrib                Annotate a symbol with a GCC attribute.\n"
-                       "  --blacklist symbol | -b symbol  Drop a given typedef or variable.\n"
+                       "  --blacklist symbol | -b symbol  Drop a given typedef or variable, or\n"
+                       "                                  every declaration matching a pattern\n"
+                       "                                  (see below).\n"
+                       "  --build-pch header | -H header  Precompile a header shared by the input\n"
+                       "                                  files into the file given by --pch\n"
+                       "                                  before pruning them.\n"
+                       "  --cache-dir dir | -c dir        Reuse parsed translation units saved in\n"
+                       "                                  dir by previous runs, and save new ones.\n"
+                       "                                  Entries are keyed on the input file and\n"
+                       "                                  arguments only, so clear dir when the\n"
+                       "                                  headers an input includes change.\n"
+                       "  --compact | -m                  Write each retained declaration on one\n"
+                       "                                  line, with spaces only between tokens\n"
+                       "                                  that would otherwise run together,\n"
+                       "                                  rather than one token per line.\n"
+                       "  --compile-commands path\n"
+                       "  -C path                         Parse each input with its command from a\n"
+                       "                                  compile_commands.json (or the one in the\n"
+                       "                                  build directory path) rather than as\n"
+                       "                                  plain C. With no input files, prune\n"
+                       "                                  every file in the database.\n"
+                       "  --dump-graph file | -G file     Write each input's call graph to file\n"
+                       "                                  (as JSON if it ends in .json, and\n"
+                       "                                  otherwise as Graphviz DOT), marking\n"
+                       "                                  what is retained. With multiple input\n"
+                       "                                  files, file must contain %%s as for\n"
+                       "                                  --output, unless --whole-program is\n"
+                       "                                  given.\n"
+                       "  --graph-cache | -g              Save the call graph of each input file\n"
+                       "                                  next to it, and reuse it while the file\n"
+                       "                                  is unchanged.\n"
                        "  --help | -?                     Print this information.\n"
-                       "  --keep symbol | -k symbol       Retain a particular function.\n"
-                       "  --output file | -o file         Write output to file, rather than stdout.\n",
+                       "  --jobs file | -J file           Prune the jobs listed in a JSON manifest\n"
+                       "                                  rather than input files (see below).\n"
+                       "  --keep symbol | -k symbol       Retain a particular function, or every\n"
+                       "                                  function matching a pattern.\n"
+                       "  --lazy | -l                     Only scan function bodies reachable from\n"
+                       "                                  kept functions, at the cost of an extra\n"
+                       "                                  traversal per function.\n"
+                       "  --output file | -o file         Write output to file, rather than stdout\n"
+                       "                                  (which can also be given as -).\n"
+                       "                                  With multiple input files, either give\n"
+                       "                                  one output per input, in order, or a\n"
+                       "                                  single output containing %%s, which is\n"
+                       "                                  replaced by each input's base name.\n"
+                       "  --pch file | -P file            Include a precompiled header (e.g. from\n"
+                       "                                  --build-pch) before each input file,\n"
+                       "                                  rather than parsing its header every\n"
+                       "                                  time. The header needs include guards if\n"
+                       "                                  the input files also #include it.\n"
+                       "  --prune-decls | -D              Also drop types, typedefs and global\n"
+                       "                                  variables that retained functions (and\n"
+                       "                                  whatever they need in turn) do not\n"
+                       "                                  refer to. --keep can then name those\n"
+                       "                                  too, with tags as, e.g., \"struct foo\".\n"
+                       "  --serve | -s                    Keep the input file loaded and answer\n"
+                       "                                  pruning requests on stdin (see below).\n"
+                       "  --skip-bodies | -B              Parse without function bodies, finding\n"
+                       "                                  calls in the bodies of reachable\n"
+                       "                                  functions from their tokens instead.\n"
+                       "                                  Faster when most functions are pruned.\n"
+                       "  --stats | -S                    Print timing and counters for each phase\n"
+                       "                                  to stderr as JSON on exit.\n"
+                       "  --threads n | -j n              Process up to n input files at once\n"
+                       "                                  (default: number of CPUs). With fewer\n"
+                       "                                  input files than that, output is\n"
+                       "                                  written by a separate thread.\n"
+                       "  --token-scan | -T               Find calls in reachable functions from\n"
+                       "                                  their tokens rather than their AST. Also\n"
+                       "                                  retains functions whose address is\n"
+                       "                                  taken.\n"
+                       "  --verbatim | -V                 Copy retained declarations from the input\n"
+                       "                                  as is, rather than one token per line.\n"
+                       "  --whole-program | -w            Treat all input files as one program,\n"
+                       "                                  following calls between them when\n"
+                       "                                  deciding what to retain.\n"
+                       "  --why symbol | -W symbol        Explain why a symbol is retained, by\n"
+                       "                                  printing a shortest chain of calls to\n"
+                       "                                  it from a kept function to stderr.\n"
+                       "\n"
+                       " A pattern is either a glob (e.g. 'seL4_*'), which must match a whole\n"
+                       " name, or an extended regular expression between slashes (e.g. '/_cap$/').\n"
+                       " The argument to --keep, --blacklist or --add-attribute can also be @file,\n"
+                       " to take one from each line of file instead.\n"
+                       "\n"
+                       " An input file of - is read from stdin, e.g. to prune the output of the\n"
+                       " preprocessor without an intermediate file.\n"
+                       "\n"
+                       " Arguments after -- are passed to Clang when parsing each input file, after\n"
+                       " -x c or the input's compile command.\n"
+                       "\n"
+                       " A --jobs manifest is an array of objects, one per job. Each has an \"input\"\n"
+                       " and optionally an \"output\" (or else --output must contain %%s), and may\n"
+                       " have arrays of strings to \"keep\", \"blacklist\", add as \"attributes\" (each\n"
+                       " as symbol:attrib) and pass to Clang as \"args\", in addition to those given\n"
+                       " on the command line. The largest inputs are pruned first.\n"
+                       "\n"
+                       " Requests in --serve mode are one per line, and each receives a line in\n"
+                       " response: either \"ok\" or \"error\" followed by a description.\n"
+                       "  keep symbol                     As for --keep, in the next prune only.\n"
+                       "  blacklist symbol                As for --blacklist, in the next prune only.\n"
+                       "  attribute symbol:attrib         As for --add-attribute, in the next prune\n"
+                       "                                  only.\n"
+                       "  reset                           Discard the above for the next prune.\n"
+                       "  prune                           Respond with \"ok n\" followed by n bytes\n"
+                       "                                  of output. The input file is reloaded\n"
+                       "                                  first if it has changed, and only\n"
+                       "                                  declarations that changed with it are\n"
+                       "                                  emitted afresh.\n"
+                       "  quit                            Exit.\n",
                     argv[0]);
                 goto fail5;
 
@@ -312,145 +655,781 @@ static options_t *parse_args(int argc, char **argv) {
         }
     }
 
-    /* Hopefully we still have an input file remaining. */
-    if (optind == argc - 1)
-        o->input = argv[optind];
-    else if (optind < argc) {
-        fprintf(stderr, "multiple input files are not supported\n");
+    /* Hopefully we still have input files remaining. */
+    o->inputs = (const char**)&argv[optind];
+    o->inputs_sz = argc - optind;
+
+    if (o->manifest != NULL) {
+        if (o->inputs_sz > 0 || o->serve || o->whole_program) {
+            fprintf(stderr, "--jobs cannot be combined with input files, "
+                "--serve or --whole-program\n");
+            goto fail5;
+        }
+        if (read_manifest(o) != 0)
+            goto fail5;
+    }
+
+    if (o->prune->compile_commands != NULL && compile_command_inputs(o) != 0) {
+        perror("failed to determine input files");
+        goto fail5;
+    }
+
+    if (o->tasks != NULL) {
+        /* Jobs without an output of their own go where a template says. */
+        bool template = o->outputs_sz == 1 &&
+            strstr(o->outputs[0], "%s") != NULL;
+        if (o->outputs_sz > 0 && !template) {
+            fprintf(stderr, "--output with --jobs must contain %%s\n");
+            goto fail5;
+        }
+        for (size_t i = 0; i < o->inputs_sz; i++) {
+            if (o->tasks[i].output == NULL && !template && o->inputs_sz > 1) {
+                fprintf(stderr, "%s: job has no output, and no --output "
+                    "containing %%s was given\n", o->inputs[i]);
+                goto fail5;
+            }
+        }
+        if (o->outputs_sz == 0)
+            o->outputs[o->outputs_sz++] = "/dev/stdout";
+    } else if (o->outputs_sz == 0 && o->inputs_sz <= 1) {
+        o->outputs[o->outputs_sz++] = "/dev/stdout";
+    } else if (o->outputs_sz != o->inputs_sz &&
+            !(o->outputs_sz == 1 && strstr(o->outputs[0], "%s") != NULL)) {
+        fprintf(stderr, "multiple input files require either one output per "
+            "input or an output containing %%s\n");
+        goto fail5;
+    }
+
+    if (o->dump_graph != NULL && o->inputs_sz > 1 && !o->whole_program &&
+            strstr(o->dump_graph, "%s") == NULL) {
+        fprintf(stderr, "--dump-graph with multiple input files requires a "
+            "file containing %%s\n");
         goto fail5;
     }
 
+    if (o->build_pch != NULL && o->prune->pch == NULL) {
+        fprintf(stderr, "--build-pch requires --pch\n");
+        goto fail5;
+    }
+
+    /* A resident translation unit is reparsed whenever its input changes, so
+     * it pays to keep the unchanged preamble around, and the output of
+     * unchanged declarations.
+     */
+    if (o->serve) {
+        o->prune->preamble = true;
+        o->prune->incremental = true;
+    }
+
+    /* Without bodies in the AST, call edges can only come from tokens. */
+    if (o->prune->skip_bodies)
+        o->prune->cfg_mode = CFG_TOKENS;
+
+    if (o->threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        o->threads = cpus > 0 ? (unsigned int)cpus : 1;
+    }
+
+    /* Threads not needed for parsing input files can write output while the
+     * rest is emitted.
+     */
+    o->prune->background_writes = o->inputs_sz < o->threads;
+
+    if (o->tasks != NULL && job_contexts(o) != 0)
+        goto fail5;
+
     return o;
 
-fail5: dict_destroy(o->extra_attributes);
-fail4: set_destroy(o->blacklist);
-fail3: set_destroy(o->keep);
+fail5: prune_destroy(o->prune);
+fail4: free(o->why);
+fail3: free(o->outputs);
 fail2: free(o);
 fail1: exit(EXIT_FAILURE);
 }
 
-/* Use the passed CFG to recursively enumerate callees of the passed "to-keep"
- * symbols and accumulate these. Returns non-zero on failure.
+/* Substitute an input's base name for the %s in a path. Returns a malloced
+ * string, or NULL on failure.
  */
-static int merge_callees(set_t *keeps, cfg_t *graph) {
+static char *substitute(const char *template, const char *input) {
+    const char *base = strrchr(input, '/');
+    base = base == NULL ? input : base + 1;
+    if (!strcmp(base, "-"))
+        base = "stdin";
+
+    const char *hole = strstr(template, "%s");
+    assert(hole != NULL);
+    size_t prefix = hole - template;
+    size_t len = strlen(template) - strlen("%s") + strlen(base);
+    char *path = malloc(len + 1);
+    if (path == NULL)
+        return NULL;
+    memcpy(path, template, prefix);
+    strcpy(path + prefix, base);
+    strcat(path, hole + strlen("%s"));
+    return path;
+}
 
-    /* A set for tracking the callees. We need to use a separate set and then
-     * post-merge this into the keeps set because we cannot insert into the
-     * keeps set while iterating through it.
-     */
-    set_t *callees = set();
-    if (callees == NULL)
+/* Determine the output path for the given input. Returns a malloced string, or
+ * NULL on failure.
+ */
+static char *output_path(const options_t *opts, size_t index) {
+    if (opts->tasks != NULL) {
+        if (opts->tasks[index].output != NULL)
+            return strdup(opts->tasks[index].output);
+        if (strstr(opts->outputs[0], "%s") == NULL)
+            /* The only job, writing to stdout. */
+            return strdup(opts->outputs[0]);
+        return substitute(opts->outputs[0], opts->inputs[index]);
+    }
+    if (opts->outputs_sz == opts->inputs_sz)
+        return strdup(opts->outputs[index]);
+    return substitute(opts->outputs[0], opts->inputs[index]);
+}
+
+/* Answer --why and write --dump-graph for a CFG whose retained symbols have
+ * been determined in a given context. Name identifies the CFG in messages, and
+ * is the input to substitute into the --dump-graph path if it has a %s.
+ * Returns non-zero on failure.
+ */
+static int report(const options_t *opts, const prune_t *p, cfg_t *graph,
+        const bitset_t *keep, bool globals, const char *name) {
+    for (size_t i = 0; i < opts->why_sz; i++) {
+        if (prune_why(p, graph, globals, opts->why[i], stderr, name) != 0)
+            return -1;
+    }
+
+    if (opts->dump_graph == NULL)
+        return 0;
+
+    char *path = strstr(opts->dump_graph, "%s") == NULL ?
+        strdup(opts->dump_graph) : substitute(opts->dump_graph, name);
+    if (path == NULL) {
+        fprintf(stderr, "%s: failed to allocate memory\n", name);
         return -1;
+    }
 
-    /* Visitor for appending each callee to the "keeps" set. */
-    enum CXChildVisitResult visitor(const char *callee, const char *caller,
-            void *_) {
+    int ret = -1;
+    size_t len = strlen(path);
+    cfg_format_t format = len >= strlen(".json") &&
+        !strcmp(path + len - strlen(".json"), ".json") ? CFG_JSON : CFG_DOT;
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "%s: failed to open %s: %s\n", name, path,
+            strerror(errno));
+    } else {
+        if (cfg_dump(graph, f, format, keep) == 0)
+            ret = 0;
+        if (fclose(f) != 0)
+            ret = -1;
+        if (ret != 0)
+            fprintf(stderr, "%s: failed to write %s\n", name, path);
+    }
+    free(path);
+    return ret;
+}
 
-        /* The CFG callee visitation calls us once per undefined function with
-         * NULL as the callee. This is useful for warning the user when the
-         * input file is incomplete and we may be pruning it too agressively.
-         */
-        if (callee == NULL) {
-            fprintf(stderr, "Warning: no definition for called function %s\n", caller);
-            return CXChildVisit_Continue;
-        }
+/* Per-file state as an input file makes its way through pruning. */
+typedef struct {
+    prune_tu_t unit;
+    const prune_t *prune;   /* the context to prune it in */
+    char *output;
+    int result;
+} job_t;
+
+/* Whether an output names our standard output, which may be a pipe, a
+ * terminal or a file opened for appending, so must be written to as it is
+ * rather than reopened, truncated and mapped.
+ */
+static bool is_stdout(const char *output) {
+    if (!strcmp(output, "-") || !strcmp(output, "/dev/stdout"))
+        return true;
+    struct stat st, out;
+    return stat(output, &st) == 0 && fstat(STDOUT_FILENO, &out) == 0 &&
+        st.st_dev == out.st_dev && st.st_ino == out.st_ino;
+}
 
-        set_insert(callees, callee);
+/* Write the declarations of a loaded input file that we want to retain to its
+ * output. Errors are reported on stderr. Returns non-zero on failure.
+ */
+static int write_output(const options_t *opts, job_t *job, bitset_t *keep) {
+    const char *input = job->unit.input;
+    const char *output = job->output;
+    int ret = -1;
+
+    /* The output is at most as large as the input, give or take added
+     * attributes, so preallocate that much.
+     */
+    size_t hint = job->unit.source->size;
 
-        return CXChildVisit_Recurse;
+    sink_t *sink = is_stdout(output) ? sink_fd(STDOUT_FILENO) :
+        sink_file(output, hint);
+    if (sink == NULL) {
+        fprintf(stderr, "%s: failed to open output %s: %s\n", input, output,
+            strerror(errno));
+        goto fail1;
     }
 
-    set_iter_t i;
-    set_iter(keeps, &i);
+    stopwatch_t w;
+    stopwatch_start(&w);
+
+    if (prune_emit(job->prune, &job->unit, keep, sink) != 0)
+        goto fail2;
+
+    stats_record(&job->unit.stats, PHASE_EMIT, &w);
+    ret = 0;
+
+fail2: if (sink_close(sink) != 0 && ret == 0) {
+        fprintf(stderr, "%s: failed to write output %s: %s\n", input, output,
+            strerror(errno));
+        ret = -1;
+    }
+fail1: return ret;
+}
 
+/* The jobs waiting for one thread, largest first (see run). */
+typedef struct {
+    size_t *jobs;           /* indices into the pool's jobs */
+    size_t head;            /* the next to take */
+    size_t tail;            /* one past the last */
+    pthread_mutex_t lock;
+} queue_t;
+
+/* Work shared between the threads pruning input files. */
+typedef struct pool {
+    const options_t *opts;
+    CXIndex index;
+    job_t *jobs;
+    bitset_t *keep;         /* in whole program mode, the global keep set */
+    stats_t stats;          /* work not attributable to any one file */
+    int (*fn)(struct pool *pool, job_t *job);
+    queue_t *queues;        /* one per thread */
+    unsigned int queues_sz;
+} pool_t;
+
+/* Prune a single input file on its own. */
+static int prune_file(pool_t *pool, job_t *job) {
+    int ret = -1;
+
+    if (prune_load(job->prune, pool->index, &job->unit) != 0)
+        goto fail1;
+
+    /* Each file expands its own copy of the kept symbols. */
+    bitset_t *keep = prune_reachable(job->prune, &job->unit);
+    if (keep == NULL)
+        goto fail1;
+
+    if (report(pool->opts, job->prune, job->unit.graph, keep,
+            !job->prune->prune_decls, job->unit.input) == 0)
+        ret = write_output(pool->opts, job, keep);
+
+    bitset_destroy(keep);
+fail1: prune_unload(&job->unit);
+    return ret;
+}
+
+/* Phases of pruning in whole program mode. */
+static int load_file(pool_t *pool, job_t *job) {
+    return prune_load(job->prune, pool->index, &job->unit);
+}
+
+static int write_file(pool_t *pool, job_t *job) {
+    return write_output(pool->opts, job, pool->keep);
+}
+
+/* Take the next job from a queue. Returns false if it is empty. */
+static bool take(queue_t *q, size_t *job) {
+    pthread_mutex_lock(&q->lock);
+    bool found = q->head < q->tail;
+    if (found)
+        *job = q->jobs[q->head++];
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+/* Take a job from another thread's queue, choosing the one with the most work
+ * left. Returns false once every queue is empty.
+ */
+static bool steal(pool_t *pool, unsigned int self, size_t *job) {
     while (true) {
-        const char *caller = set_iter_next(&i);
-        if (caller == NULL)
-            break;
+        queue_t *victim = NULL;
+        size_t most = 0;
+        for (unsigned int i = 0; i < pool->queues_sz; i++) {
+            if (i == self)
+                continue;
+            queue_t *q = &pool->queues[i];
+            pthread_mutex_lock(&q->lock);
+            size_t left = q->tail - q->head;
+            pthread_mutex_unlock(&q->lock);
+            if (left > most) {
+                victim = q;
+                most = left;
+            }
+        }
+        if (victim == NULL)
+            return false;
+        if (take(victim, job))
+            return true;
+        /* Its owner (or another thief) emptied it first. */
+    }
+}
 
-        if (cfg_visit_callees(graph, caller, visitor, NULL) == 1) {
-            /* Traversal of this particular caller's callees failed. */
-            set_destroy(callees);
-            return -1;
+typedef struct {
+    pool_t *pool;
+    unsigned int id;        /* which queue is this thread's own */
+} worker_t;
+
+static void *worker(void *arg) {
+    const worker_t *w = arg;
+    pool_t *pool = w->pool;
+    size_t i;
+    while (take(&pool->queues[w->id], &i) || steal(pool, w->id, &i))
+        pool->jobs[i].result = pool->fn(pool, &pool->jobs[i]);
+    return NULL;
+}
+
+/* Run the given function over every job, using up to the configured number of
+ * threads. Returns non-zero if any job failed.
+ *
+ * Jobs are started largest input first, as a large job started last would
+ * otherwise hold up the end of the run. They are dealt out to per-thread
+ * queues in that order, and a thread whose queue runs dry steals from the
+ * fullest of the others. Jobs are independent and coarse, so a thief steals
+ * the largest job remaining in its victim's queue, as the owner would.
+ */
+static int run(pool_t *pool, int (*fn)(pool_t *pool, job_t *job)) {
+    int ret = -1;
+    size_t jobs_sz = pool->opts->inputs_sz;
+    pool->fn = fn;
+
+    unsigned int threads = pool->opts->threads;
+    if (threads > jobs_sz)
+        threads = jobs_sz;
+
+    /* Order the jobs by the size of their inputs, largest first. */
+    size_t *order = calloc(jobs_sz, sizeof(*order));
+    off_t *sizes = calloc(jobs_sz, sizeof(*sizes));
+    pool->queues = calloc(threads, sizeof(*pool->queues));
+    worker_t *workers = calloc(threads, sizeof(*workers));
+    size_t *slots = calloc(jobs_sz, sizeof(*slots));
+    if (order == NULL || sizes == NULL || pool->queues == NULL ||
+            workers == NULL || slots == NULL) {
+        fprintf(stderr, "failed to allocate memory\n");
+        goto fail1;
+    }
+    for (size_t i = 0; i < jobs_sz; i++) {
+        struct stat st;
+        const char *input = pool->jobs[i].unit.input;
+        sizes[i] = strcmp(input, "-") && stat(input, &st) == 0 ? st.st_size : 0;
+        order[i] = i;
+    }
+    int larger(const void *a, const void *b) {
+        off_t x = sizes[*(const size_t*)a], y = sizes[*(const size_t*)b];
+        return x > y ? -1 : x < y;
+    }
+    qsort(order, jobs_sz, sizeof(*order), larger);
+
+    /* Deal the jobs out round robin, so each queue is largest first too. Each
+     * queue's jobs are a contiguous run of slots.
+     */
+    pool->queues_sz = threads;
+    size_t next = 0;
+    for (unsigned int t = 0; t < threads; t++) {
+        queue_t *q = &pool->queues[t];
+        q->jobs = &slots[next];
+        for (size_t i = t; i < jobs_sz; i += threads)
+            q->jobs[q->tail++] = order[i];
+        next += q->tail;
+        pthread_mutex_init(&q->lock, NULL);
+        workers[t] = (worker_t){ .pool = pool, .id = t };
+    }
+
+    pthread_t *tids = calloc(threads, sizeof(*tids));
+    /* This thread does work too, so only spawn n - 1 others. If thread
+     * creation fails, whoever is running steals the slack.
+     */
+    unsigned int spawned = 0;
+    while (tids != NULL && spawned + 1 < threads &&
+            pthread_create(&tids[spawned], NULL, worker,
+                &workers[spawned + 1]) == 0)
+        spawned++;
+    worker(&workers[0]);
+    for (unsigned int i = 0; i < spawned; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+
+    for (unsigned int t = 0; t < threads; t++)
+        pthread_mutex_destroy(&pool->queues[t].lock);
+
+    ret = 0;
+    for (size_t i = 0; i < jobs_sz; i++) {
+        if (pool->jobs[i].result != 0)
+            ret = -1;
+    }
+
+fail1: free(slots);
+    free(workers);
+    free(pool->queues);
+    pool->queues = NULL;
+    pool->queues_sz = 0;
+    free(sizes);
+    free(order);
+    return ret;
+}
+
+/* Prune all input files against a single call graph covering all of them, so
+ * a function called in one file and defined in another is retained correctly.
+ * Returns non-zero on failure.
+ */
+static int prune_whole_program(pool_t *pool) {
+    const options_t *opts = pool->opts;
+    int ret = -1;
+
+    /* Load every file in parallel. */
+    if (run(pool, load_file) != 0)
+        goto fail1;
+
+    /* Merge their call graphs. */
+    stopwatch_t w;
+    stopwatch_start(&w);
+    cfg_t *global = cfg_global(opts->prune->symtab);
+    if (global == NULL) {
+        fprintf(stderr, "failed to form global CFG\n");
+        goto fail1;
+    }
+    for (size_t i = 0; i < opts->inputs_sz; i++) {
+        if (cfg_merge(global, pool->jobs[i].unit.graph) != 0) {
+            fprintf(stderr, "%s: failed to merge CFG\n",
+                pool->jobs[i].unit.input);
+            goto fail2;
         }
     }
-    set_union(keeps, callees);
+
+    /* Compute what we're keeping once, for all files. */
+    pool->keep = bitset_from_set(opts->prune->keep);
+    if (pool->keep == NULL) {
+        fprintf(stderr, "failed to allocate keep set\n");
+        goto fail2;
+    }
+    if (prune_reach(opts->prune, global, pool->keep, true,
+            "whole program") != 0) {
+        fprintf(stderr, "Failed to traverse CFG\n");
+        goto fail3;
+    }
+    stats_record(&pool->stats, PHASE_REACH, &w);
+
+    if (report(opts, opts->prune, global, pool->keep, true,
+            "whole program") != 0)
+        goto fail3;
+
+    /* Now prune each file against the global result in parallel. */
+    ret = run(pool, write_file);
+
+fail3: bitset_destroy(pool->keep);
+    pool->keep = NULL;
+fail2: cfg_destroy(global);
+fail1:
+    for (size_t i = 0; i < opts->inputs_sz; i++)
+        prune_unload(&pool->jobs[i].unit);
+    return ret;
+}
+
+/* Whether two stats of a file describe the same contents, as far as we can
+ * tell.
+ */
+static bool unchanged(const struct stat *a, const struct stat *b) {
+    return a->st_ino == b->st_ino && a->st_size == b->st_size &&
+        a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+        a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/* Bring a loaded input file up to date with its contents on disk. Returns
+ * non-zero on failure, in which case the file is no longer loaded.
+ */
+static int refresh(const prune_t *p, CXIndex index, prune_tu_t *unit,
+        struct stat *loaded) {
+    struct stat st;
+    if (stat(unit->input, &st) == 0 && unchanged(&st, loaded))
+        return 0;
+
+    if (prune_reparse(p, unit) != 0) {
+        /* Reparsing doesn't work for, e.g., translation units loaded from the
+         * cache, so start again from scratch. The previous output remains
+         * valid for declarations whose text is unchanged.
+         */
+        dict_t *emitted = unit->emitted;
+        unit->emitted = NULL;
+        prune_unload(unit);
+        int err = prune_load(p, index, unit);
+        unit->emitted = emitted;
+        if (err != 0)
+            return -1;
+    }
+
+    if (stat(unit->input, loaded) != 0)
+        memset(loaded, 0, sizeof(*loaded));
     return 0;
 }
 
+/* Answer pruning requests on stdin against a resident translation unit and
+ * CFG, so repeated queries avoid paying for parsing each time. Returns non-zero
+ * on failure.
+ */
+static int serve(const options_t *opts, CXIndex index, job_t *job) {
+    int ret = -1;
+    prune_tu_t *unit = &job->unit;
+
+    struct stat loaded;
+    if (stat(unit->input, &loaded) != 0)
+        memset(&loaded, 0, sizeof(loaded));
+    if (prune_load(opts->prune, index, unit) != 0)
+        goto fail1;
+
+    buf_t *out = buf(0);
+    if (out == NULL) {
+        fprintf(stderr, "failed to allocate output buffer\n");
+        goto fail1;
+    }
+    sink_t *sink = sink_memory(out);
+    if (sink == NULL) {
+        fprintf(stderr, "failed to allocate output buffer\n");
+        buf_destroy(out);
+        goto fail1;
+    }
+
+    /* The context for the current request, which starts from the one given on
+     * the command line.
+     */
+    prune_t *req = NULL;
+
+    void release(void) {
+        if (req != NULL)
+            prune_destroy(req);
+        req = NULL;
+    }
+    bool reset(void) {
+        release();
+        req = prune_copy(opts->prune);
+        return req != NULL;
+    }
+
+    void respond(const char *status, const char *message) {
+        printf("%s%s%s\n", status, message == NULL ? "" : " ",
+            message == NULL ? "" : message);
+        fflush(stdout);
+    }
+
+    if (!reset()) {
+        fprintf(stderr, "failed to allocate request state\n");
+        goto fail2;
+    }
+
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_cap, stdin)) >= 0) {
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+
+        /* Split the request into a command and an optional argument. */
+        char *command = line;
+        char *arg = strchr(line, ' ');
+        if (arg != NULL)
+            *arg++ = '\0';
+
+        if (!strcmp(command, "keep") || !strcmp(command, "blacklist")) {
+            if (arg == NULL) {
+                respond("error", "missing symbol");
+            } else if ((command[0] == 'k' ? prune_keep(req, arg) :
+                    prune_blacklist(req, arg)) != 0) {
+                respond("error", errno == EINVAL ? "invalid pattern" :
+                    "failed to allocate memory");
+            } else {
+                respond("ok", NULL);
+            }
+
+        } else if (!strcmp(command, "attribute")) {
+            char *attrib = arg == NULL ? NULL : strstr(arg, ":");
+            if (attrib == NULL) {
+                respond("error", "expected symbol:attrib");
+            } else {
+                *attrib++ = '\0';
+                if (prune_add_attribute(req, arg, attrib) != 0)
+                    respond("error", "failed to allocate memory");
+                else
+                    respond("ok", NULL);
+            }
+
+        } else if (!strcmp(command, "reset")) {
+            if (!reset()) {
+                respond("error", "failed to allocate memory");
+                break;
+            }
+            respond("ok", NULL);
+
+        } else if (!strcmp(command, "prune")) {
+            if (refresh(req, index, unit, &loaded) != 0) {
+                respond("error", "failed to reload input file");
+                break;
+            }
+
+            buf_reset(out);
+            bitset_t *keep = prune_reachable(req, unit);
+            stopwatch_t w;
+            stopwatch_start(&w);
+            bool ok = keep != NULL && prune_emit(req, unit, keep, sink) == 0;
+            stats_record(&unit->stats, PHASE_EMIT, &w);
+            if (!ok) {
+                respond("error", "failed to prune");
+            } else {
+                printf("ok %zu\n", out->size);
+                fwrite(out->data, 1, out->size, stdout);
+                fflush(stdout);
+            }
+            if (keep != NULL)
+                bitset_destroy(keep);
+
+            /* This request is complete. */
+            if (!reset()) {
+                fprintf(stderr, "failed to allocate request state\n");
+                break;
+            }
+
+        } else if (!strcmp(command, "quit")) {
+            respond("ok", NULL);
+            ret = 0;
+            break;
+
+        } else {
+            respond("error", "unknown request");
+        }
+    }
+    if (len < 0 && feof(stdin))
+        /* The client hung up. */
+        ret = 0;
+    free(line);
+
+fail2: release();
+    sink_close(sink);
+    buf_destroy(out);
+fail1: prune_unload(unit);
+    return ret;
+}
+
+/* Write the statistics of a run to stderr as a JSON object. */
+static void print_stats(const pool_t *pool, const stopwatch_t *start) {
+    const options_t *opts = pool->opts;
+    stats_t total = pool->stats;
+
+    stopwatch_t end;
+    stopwatch_start(&end);
+
+    fprintf(stderr, "{\"files\":{");
+    for (size_t i = 0; i < opts->inputs_sz; i++) {
+        if (i > 0)
+            fputc(',', stderr);
+        stats_t s = pool->jobs[i].unit.stats;
+        s.failures += pool->jobs[i].result != 0;
+        stats_print(stderr, pool->jobs[i].unit.input, &s);
+        stats_add(&total, &s);
+    }
+    fprintf(stderr, "},");
+    stats_print(stderr, "total", &total);
+
+    struct rusage usage;
+    double cpu = 0;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+            (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    fprintf(stderr, ",\"wall\":%.6f,\"cpu\":%.6f,\"peak_rss_kb\":%ld}\n",
+        (end.wall.tv_sec - start->wall.tv_sec) +
+            (end.wall.tv_nsec - start->wall.tv_nsec) / 1e9,
+        cpu, stats_peak_rss());
+}
+
 int main(int argc, char **argv) {
+    stopwatch_t start;
+    stopwatch_start(&start);
+
     options_t *opts = parse_args(argc, argv);
 
     if (opts == NULL) {
         perror("failed to parse arguments");
         return EXIT_FAILURE;
-    } else if (opts->input == NULL) {
+    } else if (opts->inputs_sz == 0) {
         fprintf(stderr, "no input file provided\n");
         return EXIT_FAILURE;
     }
 
-    /* Test whether we can read from the file. */
-    FILE *check = fopen(opts->input, "r");
-    if (check == NULL) {
-        fprintf(stderr, "input file does not exist or is unreadable\n");
+    /* Standard input can only be read once, and serving takes requests on
+     * it.
+     */
+    size_t from_stdin = 0;
+    for (size_t i = 0; i < opts->inputs_sz; i++)
+        from_stdin += !strcmp(opts->inputs[i], "-");
+    if (from_stdin > 1 || (from_stdin > 0 && opts->serve)) {
+        fprintf(stderr, "standard input can only be given as one input file, "
+            "and not with --serve\n");
         return EXIT_FAILURE;
     }
-    fclose(check);
 
-    /* Flags to tell Clang that input is C. */
-    const char *const args[] = {
-        "-x",
-        "c",
+    pool_t pool = {
+        .opts = opts,
+        .jobs = calloc(opts->inputs_sz, sizeof(*pool.jobs)),
     };
-
-    /* Parse the source file into a translation unit */
-    CXIndex index = clang_createIndex(0, 0);
-    CXTranslationUnit tu = clang_parseTranslationUnit(index, opts->input, args,
-        sizeof(args) / sizeof(args[0]), NULL, 0, CXTranslationUnit_None);
-    if (tu == NULL) {
-        fprintf(stderr, "failed to parse source file\n");
+    if (pool.jobs == NULL) {
+        perror("failed to allocate memory");
         return EXIT_FAILURE;
     }
-
-    FILE *f = fopen(opts->output, "w");
-    if (f == NULL) {
-        perror("failed to open output");
-        return EXIT_FAILURE;
+    for (size_t i = 0; i < opts->inputs_sz; i++) {
+        pool.jobs[i].unit.input = opts->inputs[i];
+        pool.jobs[i].prune = opts->tasks == NULL ? opts->prune :
+            opts->tasks[i].prune;
+        pool.jobs[i].output = output_path(opts, i);
+        if (pool.jobs[i].output == NULL) {
+            perror("failed to allocate memory");
+            return EXIT_FAILURE;
+        }
     }
 
-    /* Derive the Control Flow Graph of the TU. We then use this CFG to expand
-     * the kept symbols set to include callees of the kept symbols.
+    /* A single index is shared by all threads, each of which works on its
+     * own translation unit.
      */
-    cfg_t *graph = cfg(tu);
-    if (graph == NULL) {
-        fprintf(stderr, "failed to form CFG");
-        if (errno != 0) {
-            perror(": ");
-        } else {
-            fprintf(stderr, "\n");
+    pool.index = clang_createIndex(0, 0);
+
+    int ret = 0;
+    if (opts->build_pch != NULL && prune_build_pch(opts->prune, pool.index,
+            opts->build_pch, opts->prune->pch) != 0) {
+        ret = EXIT_FAILURE;
+    } else if (opts->serve) {
+        if (opts->inputs_sz != 1) {
+            fprintf(stderr, "--serve requires exactly one input file\n");
+            ret = EXIT_FAILURE;
+        } else if (serve(opts, pool.index, &pool.jobs[0]) != 0) {
+            ret = EXIT_FAILURE;
         }
-        return EXIT_FAILURE;
+    } else if (opts->whole_program) {
+        if (prune_whole_program(&pool) != 0)
+            ret = EXIT_FAILURE;
+    } else if (run(&pool, prune_file) != 0) {
+        ret = EXIT_FAILURE;
     }
-    if (merge_callees(opts->keep, graph) != 0) {
-        fprintf(stderr, "Failed to traverse CFG\n");
-        return EXIT_FAILURE;
-    }
-    cfg_destroy(graph); /* no longer needed */
 
-    state_t st = {
-        .keep = opts->keep,
-        .blacklist = opts->blacklist,
-        .extra_attributes = opts->extra_attributes,
-        .tu = &tu,
-        .out = f,
-    };
+    clang_disposeIndex(pool.index);
 
-    /* Now traverse the AST */
-    CXCursor cursor = clang_getTranslationUnitCursor(tu);
-    clang_visitChildren(cursor, (CXCursorVisitor)visitor, &st);
+    if (opts->stats)
+        print_stats(&pool, &start);
 
-    clang_disposeTranslationUnit(tu);
-    clang_disposeIndex(index);
+    /* Report how each file fared. */
+    for (size_t i = 0; i < opts->inputs_sz; i++) {
+        if (opts->inputs_sz > 1)
+            fprintf(stderr, "%s -> %s: %s\n", pool.jobs[i].unit.input,
+                pool.jobs[i].output,
+                pool.jobs[i].result == 0 ? "ok" : "failed");
+        free(pool.jobs[i].output);
+    }
+    free(pool.jobs);
 
-    return 0;
+    return ret;
 }
@@ -0,0 +1,202 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#include "buf.h"
+#include <errno.h>
+#include "match.h"
+#include <pthread.h>
+#include <regex.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct matcher {
+    buf_t *source;          /* the alternation of every pattern, in ERE */
+    unsigned int patterns;
+    pthread_mutex_t lock;   /* protects compiling re */
+    bool compiled;          /* whether re is the compiled source */
+    bool failed;            /* whether compiling it failed */
+    regex_t re;
+};
+
+matcher_t *matcher(void) {
+    matcher_t *m = calloc(1, sizeof(*m));
+    if (m == NULL)
+        return NULL;
+    m->source = buf(0);
+    if (m->source == NULL || pthread_mutex_init(&m->lock, NULL) != 0) {
+        if (m->source != NULL)
+            buf_destroy(m->source);
+        free(m);
+        return NULL;
+    }
+    return m;
+}
+
+matcher_t *matcher_copy(const matcher_t *m) {
+    matcher_t *copy = matcher();
+    if (copy == NULL)
+        return NULL;
+    if (buf_append(copy->source, m->source->data, m->source->size) != 0) {
+        matcher_destroy(copy);
+        return NULL;
+    }
+    copy->patterns = m->patterns;
+    return copy;
+}
+
+void matcher_destroy(matcher_t *m) {
+    if (m->compiled)
+        regfree(&m->re);
+    pthread_mutex_destroy(&m->lock);
+    buf_destroy(m->source);
+    free(m);
+}
+
+bool matcher_is_pattern(const char *s) {
+    size_t len = strlen(s);
+    return (len >= 2 && s[0] == '/' && s[len - 1] == '/') ||
+        strpbrk(s, "*?[") != NULL;
+}
+
+/* Translate a glob into an ERE matching the same whole names. */
+static int glob_to_ere(const char *glob, buf_t *out) {
+    int err = buf_putc(out, '^');
+    for (const char *p = glob; *p != '\0' && err == 0; p++) {
+        switch (*p) {
+            case '*':
+                err = buf_puts(out, ".*");
+                break;
+            case '?':
+                err = buf_putc(out, '.');
+                break;
+            case '[':;
+                /* A bracket expression, if it is closed, which is the same in
+                 * an ERE but for the negation. A ']' straight after the '[' (or
+                 * negation) is a member rather than the end.
+                 */
+                const char *q = p + 1;
+                if (*q == '!' || *q == '^')
+                    q++;
+                if (*q == ']')
+                    q++;
+                const char *close = strchr(q, ']');
+                if (close == NULL) {
+                    err = buf_puts(out, "\\[");
+                    break;
+                }
+                err = buf_putc(out, '[');
+                q = p + 1;
+                if (*q == '!' || *q == '^') {
+                    err |= buf_putc(out, '^');
+                    q++;
+                }
+                err |= buf_append(out, q, close - q + 1);
+                p = close;
+                break;
+            case '\\':
+                /* Escapes the next character, if there is one. */
+                if (p[1] != '\0')
+                    p++;
+                /* fall through */
+            default:
+                if (strchr(".^$+(){}|[]*?\\", *p) != NULL)
+                    err = buf_putc(out, '\\');
+                err |= buf_putc(out, *p);
+                break;
+        }
+    }
+    return err | buf_putc(out, '$');
+}
+
+int matcher_add(matcher_t *m, const char *pattern) {
+    buf_t *ere = buf(0);
+    if (ere == NULL)
+        return -1;
+
+    int err = buf_putc(ere, '(');
+    size_t len = strlen(pattern);
+    if (len >= 2 && pattern[0] == '/' && pattern[len - 1] == '/')
+        err |= buf_append(ere, pattern + 1, len - 2);
+    else
+        err |= glob_to_ere(pattern, ere);
+    err |= buf_putc(ere, ')');
+    err |= buf_putc(ere, '\0');
+
+    /* Compile it alone to check it is valid, so a bad pattern is reported
+     * here rather than breaking the whole alternation.
+     */
+    regex_t re;
+    int invalid = 0;
+    if (err == 0 &&
+            (invalid = regcomp(&re, ere->data, REG_EXTENDED | REG_NOSUB)) == 0)
+        regfree(&re);
+    else
+        err = -1;
+
+    if (err == 0) {
+        size_t size = m->source->size;
+        if ((m->patterns > 0 && buf_putc(m->source, '|') != 0) ||
+                buf_append(m->source, ere->data, ere->size - 1) != 0) {
+            m->source->size = size;
+            err = -1;
+        }
+    }
+    buf_destroy(ere);
+    if (err != 0) {
+        errno = invalid != 0 && invalid != REG_ESPACE ? EINVAL : ENOMEM;
+        return -1;
+    }
+
+    m->patterns++;
+    if (m->compiled) {
+        regfree(&m->re);
+        m->compiled = false;
+    }
+    m->failed = false;
+    return 0;
+}
+
+bool matcher_empty(const matcher_t *m) {
+    return m->patterns == 0;
+}
+
+bool matcher_match(matcher_t *m, const char *name) {
+    if (m->patterns == 0)
+        return false;
+
+    /* Compile on first use, so adding many patterns costs one compilation. */
+    if (!__atomic_load_n(&m->compiled, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&m->lock);
+        if (!m->compiled && !m->failed) {
+            /* The source is terminated only while it is compiled, so more
+             * patterns can be appended later.
+             */
+            if (buf_putc(m->source, '\0') == 0) {
+                if (regcomp(&m->re, m->source->data,
+                        REG_EXTENDED | REG_NOSUB) == 0)
+                    __atomic_store_n(&m->compiled, true, __ATOMIC_RELEASE);
+                else
+                    m->failed = true;
+                m->source->size--;
+            } else {
+                m->failed = true;
+            }
+        }
+        pthread_mutex_unlock(&m->lock);
+        if (!m->compiled) {
+            /* Only memory exhaustion should get us here. */
+            return false;
+        }
+    }
+
+    return regexec(&m->re, name, 0, NULL, 0) == 0;
+}
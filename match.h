@@ -0,0 +1,46 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#ifndef _MATCH_H_
+#define _MATCH_H_
+
+/* Matching of symbol names against a collection of patterns: globs (e.g.
+ * "seL4_*", with *, ? and [...] as for fnmatch) and POSIX extended regular
+ * expressions between slashes (e.g. "/_cap$/"). A glob must match a whole
+ * name, whereas a regular expression may match any part of one unless it is
+ * anchored. All the patterns are compiled together into a single regular
+ * expression, so a name is tested against every pattern in one match. Once
+ * populated, a matcher may be used by several threads at once.
+ */
+
+#include <stdbool.h>
+
+typedef struct matcher matcher_t;
+
+/* Returns NULL on failure. */
+matcher_t *matcher(void);
+matcher_t *matcher_copy(const matcher_t *m);
+void matcher_destroy(matcher_t *m);
+
+/* Whether a string is a pattern, rather than a literal name. */
+bool matcher_is_pattern(const char *s);
+
+/* Add a pattern. Returns non-zero if the pattern is invalid (with errno set to
+ * EINVAL) or on failure (ENOMEM), in which case the matcher is unchanged.
+ */
+int matcher_add(matcher_t *m, const char *pattern);
+
+/* Whether the matcher has no patterns, and hence matches nothing. */
+bool matcher_empty(const matcher_t *m);
+
+/* Whether a name matches any of the patterns. */
+bool matcher_match(matcher_t *m, const char *name);
+
+#endif
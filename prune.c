@@ -0,0 +1,1613 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#include "bitset.h"
+#include "buf.h"
+#include "cache.h"
+#include "cfg.h"
+#include <clang-c/CXCompilationDatabase.h>
+#include <clang-c/Index.h> /* -lclang */
+#include <ctype.h>
+#include "dict.h"
+#include <errno.h>
+#include <libgen.h>
+#include "prune.h"
+#include <pthread.h>
+#include "set.h"
+#include "sink.h"
+#include "source.h"
+#include "stats.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "symtab.h"
+#include <unistd.h>
+
+//#define DEBUG 1
+
+/* We want to implement a rewriter (or source-to-source translator). The
+ * standard way of doing this would be to sub-class RecursiveASTVisitor and go
+ * from there. After several attempts I gave up on getting either of the Clang
+ * C++ or Python bindings to compile and link and resorted to the below in C.
+ */
+
+/* Determine whether a given declaration is in our list of entities to never
+ * emit.
+ */
+static bool is_blacklisted(const bitset_t *blacklist, const cfg_decl_t *decl) {
+    return bitset_contains(blacklist, decl->name);
+}
+
+/* State data that we'll pass around while visiting the AST. */
+typedef struct {
+    symtab_t *symtab;
+    bitset_t *keep;
+    const bitset_t *blacklist;
+    dict_t *extra_attributes;
+    CXTranslationUnit *tu;
+    const source_t *source; /* the mapped input file */
+    CXFile file;            /* libclang's handle to the same file */
+    buf_t *buf;             /* output not yet written */
+    sink_t *out;            /* where to flush output, if anywhere */
+    struct writer *writer;  /* what to hand output to instead, if anything */
+    bool verbatim;          /* copy declarations with their formatting */
+    bool compact;           /* separate tokens only where necessary */
+    stats_t *stats;
+    int err;                /* errno of the first failure to buffer or flush
+                             * output, or 0 */
+    dict_t *previous;       /* output of the last emission, or NULL */
+    dict_t *emitted;        /* output of this emission, if incremental */
+} state_t;
+
+/* The output of a declaration, kept so it can be reused by the next emission
+ * while the declaration's text is unchanged. Declarations of the same name are
+ * chained together.
+ */
+typedef struct memo {
+    uint64_t hash;          /* of the input the declaration's tokens span */
+    char *text;             /* NULL once reused */
+    size_t text_sz;
+    struct memo *next;
+} memo_t;
+
+static void memo_destroy(void *value) {
+    memo_t *m = value;
+    while (m != NULL) {
+        memo_t *next = m->next;
+        free(m->text);
+        free(m);
+        m = next;
+    }
+}
+
+/* Record the output of a declaration, taking ownership of its text. Returns
+ * false on failure.
+ */
+static bool memo_add(dict_t *memo, sym_t name, uint64_t hash, char *text,
+        size_t text_sz) {
+    memo_t *m = malloc(sizeof(*m));
+    if (m == NULL)
+        return false;
+    m->hash = hash;
+    m->text = text;
+    m->text_sz = text_sz;
+
+    /* Chain after any existing head, which dict_set would destroy. */
+    memo_t *head = dict_get(memo, name);
+    if (head == NULL) {
+        m->next = NULL;
+        dict_set(memo, name, m);
+    } else {
+        m->next = head->next;
+        head->next = m;
+    }
+    return true;
+}
+
+/* Find unclaimed output of a declaration with the given name and text. */
+static memo_t *memo_find(dict_t *memo, sym_t name, uint64_t hash) {
+    for (memo_t *m = dict_get(memo, name); m != NULL; m = m->next) {
+        if (m->hash == hash && m->text != NULL)
+            return m;
+    }
+    return NULL;
+}
+
+/* Output is accumulated in user space and written whenever it exceeds this
+ * many bytes.
+ */
+#define OUTPUT_CHUNK (1024 * 1024)
+
+/* With background writes, chunks of output are handed from the thread
+ * emitting declarations to a second thread that writes them to the sink, so
+ * tokenizing and writing overlap. The chunks form a ring: the emitter fills
+ * one while the writer drains those handed over before it, strictly in order.
+ */
+#define WRITER_DEPTH 4
+
+typedef struct writer {
+    sink_t *sink;
+    buf_t *bufs[WRITER_DEPTH];
+    unsigned long filled;       /* chunks handed to the writer */
+    unsigned long written;      /* chunks the writer has finished with */
+    bool done;                  /* whether any more chunks are coming */
+    int err;                    /* errno of the first failed write, or 0 */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} writer_t;
+
+static void *writer_main(void *arg) {
+    writer_t *w = arg;
+
+    pthread_mutex_lock(&w->lock);
+    while (true) {
+        while (w->written == w->filled && !w->done)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if (w->written == w->filled)
+            break;
+        buf_t *b = w->bufs[w->written % WRITER_DEPTH];
+        bool failed = w->err != 0;
+        pthread_mutex_unlock(&w->lock);
+
+        /* After a failure, chunks are discarded rather than written, so the
+         * emitter is never left waiting.
+         */
+        int err = 0;
+        if (!failed && sink_flush(w->sink, b) != 0)
+            err = errno != 0 ? errno : EIO;
+        buf_reset(b);
+
+        pthread_mutex_lock(&w->lock);
+        if (w->err == 0)
+            w->err = err;
+        w->written++;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+/* Start a writer, whose first chunk to fill is the given buffer. Returns
+ * non-zero on failure.
+ */
+static int writer_start(writer_t *w, sink_t *sink, buf_t *first) {
+    memset(w, 0, sizeof(*w));
+    w->sink = sink;
+    w->bufs[0] = first;
+    for (unsigned int i = 1; i < WRITER_DEPTH; i++) {
+        w->bufs[i] = buf(OUTPUT_CHUNK * 2);
+        if (w->bufs[i] == NULL)
+            goto fail1;
+    }
+
+    if (pthread_mutex_init(&w->lock, NULL) != 0)
+        goto fail1;
+    if (pthread_cond_init(&w->cond, NULL) != 0)
+        goto fail2;
+    if (pthread_create(&w->thread, NULL, writer_main, w) != 0)
+        goto fail3;
+    return 0;
+
+fail3: pthread_cond_destroy(&w->cond);
+fail2: pthread_mutex_destroy(&w->lock);
+fail1: for (unsigned int i = 1; i < WRITER_DEPTH; i++) {
+        if (w->bufs[i] != NULL)
+            buf_destroy(w->bufs[i]);
+    }
+    return -1;
+}
+
+/* Hand the chunk being filled to the writer, and return the next one to fill
+ * once the writer has finished with it.
+ */
+static buf_t *writer_handover(writer_t *w) {
+    pthread_mutex_lock(&w->lock);
+    w->filled++;
+    pthread_cond_broadcast(&w->cond);
+    while (w->filled - w->written >= WRITER_DEPTH)
+        pthread_cond_wait(&w->cond, &w->lock);
+    buf_t *b = w->bufs[w->filled % WRITER_DEPTH];
+    pthread_mutex_unlock(&w->lock);
+    return b;
+}
+
+/* Hand over the final chunk, wait for everything to be written and stop the
+ * writer. The first buffer is left to the caller. Returns the errno of the
+ * first failed write, or 0.
+ */
+static int writer_finish(writer_t *w, buf_t *last) {
+    pthread_mutex_lock(&w->lock);
+    if (last->size > 0)
+        w->filled++;
+    w->done = true;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_join(w->thread, NULL);
+
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+    for (unsigned int i = 1; i < WRITER_DEPTH; i++)
+        buf_destroy(w->bufs[i]);
+    return w->err;
+}
+
+/* The text of a token. */
+typedef struct {
+    const char *text;
+    size_t len;
+    bool spelled;       /* whether we had to ask libclang for the text */
+    CXString spelling;  /* if so, the string to dispose of */
+} token_text_t;
+
+/* Find the byte offsets of a token within the input file. Returns false if
+ * the token does not lie within the input file.
+ */
+static bool token_offsets(const state_t *state, CXToken token, unsigned *start,
+        unsigned *end) {
+    CXSourceRange extent = clang_getTokenExtent(*state->tu, token);
+    CXFile start_file, end_file;
+    clang_getSpellingLocation(clang_getRangeStart(extent), &start_file, NULL,
+        NULL, start);
+    clang_getSpellingLocation(clang_getRangeEnd(extent), &end_file, NULL, NULL,
+        end);
+    return state->file != NULL && start_file == state->file &&
+        end_file == state->file && *start <= *end &&
+        *end <= state->source->size;
+}
+
+/* Find the text of a token. Where the token lies within the input file we
+ * point directly into our mapping of it, rather than paying for libclang to
+ * allocate a copy.
+ */
+static void token_text(const state_t *state, CXToken token, token_text_t *t) {
+    unsigned start, end;
+    if (token_offsets(state, token, &start, &end)) {
+        t->text = state->source->data + start;
+        t->len = end - start;
+        t->spelled = false;
+        return;
+    }
+
+    /* Fall back to spelling the token, e.g. for text from another file. */
+    t->spelling = clang_getTokenSpelling(*state->tu, token);
+    t->text = clang_getCString(t->spelling);
+    t->len = strlen(t->text);
+    t->spelled = true;
+}
+
+static void token_text_dispose(token_text_t *t) {
+    if (t->spelled)
+        clang_disposeString(t->spelling);
+}
+
+/* Record the failure of an operation on the output buffer, if it failed. */
+static void check(state_t *state, int err) {
+    if (err != 0 && state->err == 0)
+        state->err = errno != 0 ? errno : ENOMEM;
+}
+
+/* Precede the last token of a declaration with any extra attributes. */
+static void emit_attributes(state_t *state, set_t *attribs,
+        const char *separator) {
+    void print_attribute(sym_t attrib) {
+        check(state, buf_puts(state->buf, "__attribute__(("));
+        check(state, buf_puts(state->buf, symtab_name(state->symtab, attrib)));
+        check(state, buf_puts(state->buf, "))"));
+        check(state, buf_puts(state->buf, separator));
+    }
+    set_foreach(attribs, print_attribute);
+}
+
+/* XXX: Yet more hackery. Libclang misparses a trailing attribute on a typedef.
+ * This should appear in the AST as an UnexposedDecl, but for whatever reason
+ * it doesn't. No idea from whence this behaviour stems as Clang itself just
+ * removes the attribute from the AST altogether entirely. We emit this in
+ * place of the trailing __attribute__ token.
+ */
+#define TRAILING_ATTRIBUTE_REPLACEMENT "; "
+
+/* Whether a token would run into the one following it if they were written
+ * with nothing in between, forming different tokens (e.g. "a" "b" as "ab",
+ * "+" "+" as "++", "1" ".5" as "1.5" or "L" "'x'" as a wide character). Last
+ * is the final character of the first token and number is whether it is a
+ * number. This errs on the side of separating tokens that would not merge.
+ */
+static bool needs_space(char last, bool number, const char *next) {
+    char first = next[0];
+    bool word = isalnum((unsigned char)last) || last == '_';
+    bool next_word = isalnum((unsigned char)first) || first == '_';
+    bool quote = last == '\'' || last == '"';
+    bool next_quote = first == '\'' || first == '"';
+
+    if ((word || quote) && (next_word || next_quote))
+        return true;
+
+    /* Numbers continue through dots and signed exponents. */
+    if (number && (first == '.' || ((first == '+' || first == '-') &&
+            strchr("eEpP", last) != NULL)))
+        return true;
+    if (last == '.' && (isdigit((unsigned char)first) || first == '.'))
+        return true;
+
+    /* Punctuators that would combine into a longer one (or a comment). */
+    const char *joins;
+    switch (last) {
+        case '+': joins = "+="; break;
+        case '-': joins = "-=>"; break;
+        case '*': joins = "="; break;
+        case '/': joins = "=*/"; break;
+        case '%': joins = "=>:"; break;
+        case '&': joins = "&="; break;
+        case '|': joins = "|="; break;
+        case '^': joins = "="; break;
+        case '<': joins = "<=:%"; break;
+        case '>': joins = ">="; break;
+        case '=': joins = "="; break;
+        case '!': joins = "="; break;
+        case '#': joins = "#"; break;
+        case ':': joins = ">"; break;
+        default: return false;
+    }
+    return first != '\0' && strchr(joins, first) != NULL;
+}
+
+/* The line of the input a token was spelled on. */
+static unsigned token_line(const state_t *state, CXToken token) {
+    unsigned line;
+    clang_getSpellingLocation(clang_getTokenLocation(*state->tu, token), NULL,
+        &line, NULL, NULL);
+    return line;
+}
+
+/* Dump a declaration's tokens, not trying to preserve white space. Tokens are
+ * written one per line or, if compacting, on one line with a space only
+ * between those that would otherwise run together. Even then, preprocessor
+ * directives among the tokens (e.g. line markers) get lines of their own.
+ */
+static void emit_tokens(state_t *state, CXToken *tokens, unsigned tokens_sz,
+        set_t *attribs, bool trailing_attribute) {
+    buf_t *out = state->buf;
+    bool compact = state->compact;
+    bool line_start = true;     /* nothing written on this line yet */
+    char last = '\0';           /* final character of the previous token */
+    bool number = false;        /* whether the previous token was a number */
+    unsigned directive = 0;     /* line of the directive we are in, if any */
+
+    for (unsigned int i = 0; i < tokens_sz; i++) {
+        if (i == tokens_sz - 1) {
+            if (attribs != NULL) {
+                if (compact && !line_start)
+                    check(state, buf_putc(out, ' '));
+                emit_attributes(state, attribs, compact ? " " : "\n");
+                line_start = !compact;
+                last = ' ';
+            }
+            if (trailing_attribute) {
+                check(state, buf_puts(out, TRAILING_ATTRIBUTE_REPLACEMENT));
+                line_start = false;
+                break;
+            }
+        }
+        token_text_t token;
+        token_text(state, tokens[i], &token);
+
+        if (compact) {
+            /* A '#' first on its line starts a directive, which lasts until
+             * the end of that line.
+             */
+            bool newline = false;
+            if (token.len == 1 && token.text[0] == '#') {
+                unsigned line = token_line(state, tokens[i]);
+                if (i == 0 || token_line(state, tokens[i - 1]) != line) {
+                    newline = true;
+                    directive = line;
+                }
+            } else if (directive != 0 &&
+                    token_line(state, tokens[i]) != directive) {
+                newline = true;
+                directive = 0;
+            }
+            if (newline && !line_start) {
+                check(state, buf_putc(out, '\n'));
+                line_start = true;
+            }
+            if (!line_start && needs_space(last, number, token.text))
+                check(state, buf_putc(out, ' '));
+        }
+
+        check(state, buf_append(out, token.text, token.len));
+        if (compact) {
+            last = token.text[token.len - 1];
+            number = isdigit((unsigned char)token.text[0]) ||
+                (token.text[0] == '.' && token.len > 1);
+            line_start = false;
+        } else {
+            check(state, buf_putc(out, '\n'));
+        }
+        token_text_dispose(&token);
+    }
+
+    if (compact && !line_start)
+        check(state, buf_putc(out, '\n'));
+}
+
+/* Dump a declaration as the original bytes of the input file it spans,
+ * preserving formatting and comments. Returns false if the declaration does
+ * not lie within the input file, in which case nothing is emitted.
+ */
+static bool emit_verbatim(state_t *state, CXToken *tokens, unsigned tokens_sz,
+        set_t *attribs, bool trailing_attribute) {
+    unsigned start, end, last_start, last_end;
+    if (!token_offsets(state, tokens[0], &start, &end) ||
+            !token_offsets(state, tokens[tokens_sz - 1], &last_start, &last_end) ||
+            last_start < start)
+        return false;
+
+    const char *data = state->source->data;
+    if (attribs == NULL && !trailing_attribute) {
+        check(state, buf_append(state->buf, data + start, last_end - start));
+    } else {
+        /* We need to splice something in before the last token. */
+        check(state, buf_append(state->buf, data + start, last_start - start));
+        if (attribs != NULL)
+            emit_attributes(state, attribs, " ");
+        if (trailing_attribute)
+            check(state, buf_puts(state->buf, TRAILING_ATTRIBUTE_REPLACEMENT));
+        else
+            check(state, buf_append(state->buf, data + last_start,
+                last_end - last_start));
+    }
+    check(state, buf_putc(state->buf, '\n'));
+    return true;
+}
+
+/* Hash the input text spanned by the tokens of a declaration, which is all its
+ * output depends on besides its kind, the output format and any extra
+ * attributes. This takes in the excess token libclang includes after some
+ * declarations (see emit), whose text decides how the declaration is emitted.
+ * The format is mixed in too, as a context's settings may change between
+ * emissions. Returns false if the tokens do not lie within the input file.
+ */
+static bool decl_hash(const state_t *state, const cfg_decl_t *decl,
+        CXToken *tokens, unsigned tokens_sz, uint64_t *hash) {
+    unsigned start, end, last_start, last_end;
+    if (tokens_sz == 0 || !token_offsets(state, tokens[0], &start, &end) ||
+            !token_offsets(state, tokens[tokens_sz - 1], &last_start,
+                &last_end) ||
+            last_end < start)
+        return false;
+
+    /* 64-bit FNV-1a. */
+    uint64_t h = 14695981039346656037ULL;
+    void mix(unsigned char byte) {
+        h ^= byte;
+        h *= 1099511628211ULL;
+    }
+    mix((unsigned char)decl->kind);
+    mix(decl->definition);
+    mix(state->verbatim);
+    mix(state->compact);
+    for (unsigned i = start; i < last_end; i++)
+        mix((unsigned char)state->source->data[i]);
+    *hash = h;
+    return true;
+}
+
+/* Dump a given declaration, whose extent has been tokenized, to the output
+ * buffer.
+ */
+static void emit(state_t *state, const cfg_decl_t *decl, set_t *attribs,
+        CXToken *tokens, unsigned int tokens_sz) {
+    CXTranslationUnit tu = *state->tu;
+
+    /* Bail out early if possible to reduce complexity in the follow on logic.
+     */
+    if (tokens_sz == 0)
+        return;
+
+    /* Now time to deal with Clang's quirks. */
+
+    /* Grab the last token. */
+    CXString cxlast = clang_getTokenSpelling(tu, tokens[tokens_sz - 1]);
+    const char *last = clang_getCString(cxlast);
+
+    /* Grab the first token. */
+    CXString cxfirst = clang_getTokenSpelling(tu, tokens[0]);
+    const char *first = clang_getCString(cxfirst);
+
+    enum CXCursorKind kind = decl->kind;
+
+#ifdef DEBUG
+    CXString cxkind = clang_getTypeKindSpelling(kind);
+    const char *k = clang_getCString(cxkind);
+    fprintf(stderr, "Cursor %s of kind %s\n",
+        symtab_name(state->symtab, decl->name), k);
+    clang_disposeString(cxkind);
+#endif
+
+    switch (kind) {
+
+        /* XXX: If the cursor is an empty `;`, its extent covers the
+         * (unrelated) following token as well. Libclang bug?
+         * We could potentially just return here, but for now we will emit
+         * the ';' anyway.  Decreasing the tokens_sz prevents us from also
+         * emitting the unrelated following token.
+         */
+        case CXCursor_UnexposedDecl:
+            if (!strcmp(first, ";")) {
+                tokens_sz--;
+            }
+            break;
+
+        /* XXX: If the cursor is a function definition, its extent covers the
+         * (unrelated) following token as well. Libclang bug? An exception is
+         * that a function appearing at the end of the translation unit will not
+         * have an extra appended token. To cope with this, assume we never want to strip
+         * closing braces.
+         */
+        case CXCursor_FunctionDecl:
+            if (decl->definition && strcmp(last, "}"))
+                tokens_sz--;
+            break;
+
+        /* XXX: In code like 'typedef struct foo {...} foo_t', Clang considers
+         * foo and foo_t siblings. We end up visiting foo, then foo_t. In my
+         * mind, foo is a child of foo_t, but maybe Clang's outlook makes more
+         * sense from a scoping point of view. Either way, it helpfully covers
+         * an extra token in the foo cursor, so we can play the same trick as
+         * above to elide the (excess) struct definition.
+         */
+        case CXCursor_StructDecl:
+        case CXCursor_UnionDecl:
+        case CXCursor_EnumDecl:
+            if (strcmp(last, ";") && strcmp(last, "}")) {
+                clang_disposeString(cxlast);
+                clang_disposeString(cxfirst);
+                return;
+            }
+            break;
+
+        /* XXX: When multiple variables are declared in a single statement:
+         *  int x, y;
+         * the declaration appears once per variable. Only the final instance
+         * is terminated with a semi-colon and only it is valid.
+         */
+        case CXCursor_TypedefDecl:
+        case CXCursor_VarDecl:
+            /* To add insult to injury, typedefed structs with trailing
+             * __attribute__s come out with nothing following the
+             * __attribute__. Why? Who knows. In this case we actually *do*
+             * want to emit them. Probably. Of course this logic breaks down in
+             * the case of code like:
+             *  typedef struct f { int x; } y, z __attribute__(...);
+             * but I don't easily see how to resolve situations like this.
+             */
+            if (!strcmp(last, "__attribute__"))
+                break;
+            if (strcmp(last, ";")) {
+                clang_disposeString(cxlast);
+                clang_disposeString(cxfirst);
+                return;
+            }
+
+        default: /* shut -Wswitch warnings up */
+            break;
+    }
+
+    /* Trimming the excess token may have left nothing to emit. */
+    if (tokens_sz == 0) {
+        clang_disposeString(cxlast);
+        clang_disposeString(cxfirst);
+        return;
+    }
+
+    state->stats->tokens += tokens_sz;
+    size_t start = state->buf->size;
+
+    /* A trailing __attribute__ on a typedef or variable needs to be replaced
+     * (see TRAILING_ATTRIBUTE_REPLACEMENT).
+     */
+    bool trailing_attribute =
+        (kind == CXCursor_TypedefDecl || kind == CXCursor_VarDecl) &&
+        !strcmp(last, "__attribute__");
+
+    clang_disposeString(cxlast);
+    clang_disposeString(cxfirst);
+
+    if (!state->verbatim ||
+            !emit_verbatim(state, tokens, tokens_sz, attribs, trailing_attribute))
+        emit_tokens(state, tokens, tokens_sz, attribs, trailing_attribute);
+
+    state->stats->bytes += state->buf->size - start;
+}
+
+/* Visit a top-level declaration. If we are pruning all declarations, needed
+ * points to whether this one is needed (see cfg_needed). Otherwise it is NULL.
+ */
+static void visitor(const cfg_decl_t *decl, const bool *needed,
+        state_t *state) {
+
+    bool retain = true;
+
+    if (needed != NULL) {
+        retain = *needed;
+    } else if (decl->kind == CXCursor_FunctionDecl) {
+        /* Determine whether the function was one of those the user requested
+         * to keep. */
+        retain = bitset_contains(state->keep, decl->name);
+    } else if (decl->kind == CXCursor_VarDecl && decl->internal) {
+        /* A static variable is only needed if something we retain refers to
+         * it (see cfg_globals).
+         */
+        retain = bitset_contains(state->keep, decl->name);
+    }
+
+    if (retain && is_blacklisted(state->blacklist, decl))
+        retain = false;
+
+    if (decl->kind == CXCursor_FunctionDecl && decl->definition) {
+        if (retain)
+            state->stats->retained++;
+        else
+            state->stats->dropped++;
+    }
+
+    if (!retain)
+        return;
+
+    /* Get any extra attributes we need to apply to this symbol. */
+    set_t *attribs = dict_get(state->extra_attributes, decl->name);
+
+    /* If we reached here, the current declaration is one we do want in the
+     * output. When emitting incrementally, we reuse its previous output if its
+     * text is unchanged. Extra attributes can differ from one emission to the
+     * next, so declarations with any are always emitted afresh.
+     */
+    CXToken *tokens;
+    unsigned int tokens_sz;
+    clang_tokenize(*state->tu, decl->extent, &tokens, &tokens_sz);
+    uint64_t hash;
+    bool memoise = state->emitted != NULL && attribs == NULL &&
+        decl_hash(state, decl, tokens, tokens_sz, &hash);
+    memo_t *prev = memoise && state->previous != NULL ?
+        memo_find(state->previous, decl->name, hash) : NULL;
+    if (prev != NULL) {
+        check(state, buf_append(state->buf, prev->text, prev->text_sz));
+        state->stats->bytes += prev->text_sz;
+        state->stats->reused++;
+        if (memo_add(state->emitted, decl->name, hash, prev->text,
+                prev->text_sz))
+            prev->text = NULL;
+    } else {
+        size_t start = state->buf->size;
+        emit(state, decl, attribs, tokens, tokens_sz);
+
+        /* Failing to keep the output only costs us reuse next time. */
+        size_t len = state->buf->size - start;
+        char *text = memoise && len > 0 ? malloc(len) : NULL;
+        if (text != NULL) {
+            memcpy(text, state->buf->data + start, len);
+            if (!memo_add(state->emitted, decl->name, hash, text, len))
+                free(text);
+        }
+    }
+    clang_disposeTokens(*state->tu, tokens, tokens_sz);
+
+    if (state->buf->size >= OUTPUT_CHUNK) {
+        if (state->writer != NULL)
+            state->buf = writer_handover(state->writer);
+        else if (state->out != NULL &&
+                sink_flush(state->out, state->buf) != 0 && state->err == 0)
+            state->err = errno != 0 ? errno : EIO;
+    }
+}
+
+/* Copy a dictionary of extra attributes. Returns NULL on failure. */
+static dict_t *copy_attributes(dict_t *attributes) {
+    dict_t *copy = dict((void(*)(void*))set_destroy);
+    if (copy == NULL)
+        return NULL;
+    bool ok = true;
+    void add(sym_t symbol, void *value) {
+        set_t *s = set_copy(value);
+        if (s == NULL)
+            ok = false;
+        else
+            dict_set(copy, symbol, s);
+    }
+    dict_foreach(attributes, add);
+    if (!ok) {
+        dict_destroy(copy);
+        return NULL;
+    }
+    return copy;
+}
+
+
+/* Record that a symbol should be annotated with an extra attribute. Returns
+ * non-zero on failure.
+ */
+static int add_attribute(symtab_t *symtab, dict_t *attributes,
+        const char *symbol, const char *attrib) {
+    sym_t sym = symtab_intern(symtab, symbol);
+    sym_t attribute = symtab_intern(symtab, attrib);
+    if (sym == SYM_NONE || attribute == SYM_NONE)
+        return -1;
+    set_t *s = dict_get(attributes, sym);
+    if (s == NULL) {
+        s = set();
+        if (s == NULL)
+            return -1;
+        dict_set(attributes, sym, s);
+    }
+    set_insert(s, attribute);
+    return 0;
+}
+
+prune_t *prune(void) {
+    prune_t *p = calloc(1, sizeof(*p));
+    if (p == NULL)
+        goto fail1;
+
+    /* defaults */
+    p->cfg_mode = CFG_EAGER;
+
+    p->symtab = symtab();
+    if (p->symtab == NULL)
+        goto fail2;
+
+    p->keep = set();
+    if (p->keep == NULL)
+        goto fail3;
+
+    p->blacklist = set();
+    if (p->blacklist == NULL)
+        goto fail4;
+
+    p->extra_attributes = dict((void(*)(void*))set_destroy);
+    if (p->extra_attributes == NULL)
+        goto fail5;
+
+    p->keep_patterns = matcher();
+    if (p->keep_patterns == NULL)
+        goto fail6;
+
+    p->blacklist_patterns = matcher();
+    if (p->blacklist_patterns == NULL)
+        goto fail7;
+
+    return p;
+
+fail7: matcher_destroy(p->keep_patterns);
+fail6: dict_destroy(p->extra_attributes);
+fail5: set_destroy(p->blacklist);
+fail4: set_destroy(p->keep);
+fail3: symtab_destroy(p->symtab);
+fail2: free(p);
+fail1: return NULL;
+}
+
+prune_t *prune_copy(const prune_t *p) {
+    prune_t *q = malloc(sizeof(*q));
+    if (q == NULL)
+        goto fail1;
+    *q = *p;
+    q->shared = true;
+
+    q->keep = set_copy(p->keep);
+    if (q->keep == NULL)
+        goto fail2;
+
+    q->blacklist = set_copy(p->blacklist);
+    if (q->blacklist == NULL)
+        goto fail3;
+
+    q->extra_attributes = copy_attributes(p->extra_attributes);
+    if (q->extra_attributes == NULL)
+        goto fail4;
+
+    q->keep_patterns = matcher_copy(p->keep_patterns);
+    if (q->keep_patterns == NULL)
+        goto fail5;
+
+    q->blacklist_patterns = matcher_copy(p->blacklist_patterns);
+    if (q->blacklist_patterns == NULL)
+        goto fail6;
+
+    return q;
+
+fail6: matcher_destroy(q->keep_patterns);
+fail5: dict_destroy(q->extra_attributes);
+fail4: set_destroy(q->blacklist);
+fail3: set_destroy(q->keep);
+fail2: free(q);
+fail1: return NULL;
+}
+
+void prune_destroy(prune_t *p) {
+    matcher_destroy(p->blacklist_patterns);
+    matcher_destroy(p->keep_patterns);
+    dict_destroy(p->extra_attributes);
+    set_destroy(p->blacklist);
+    set_destroy(p->keep);
+    if (!p->shared) {
+        if (p->compile_commands != NULL)
+            clang_CompilationDatabase_dispose(p->compile_commands);
+        symtab_destroy(p->symtab);
+    }
+    free(p);
+}
+
+int prune_keep(prune_t *p, const char *symbol) {
+    if (matcher_is_pattern(symbol))
+        return matcher_add(p->keep_patterns, symbol);
+    sym_t sym = symtab_intern(p->symtab, symbol);
+    if (sym == SYM_NONE)
+        return -1;
+    set_insert(p->keep, sym);
+    return 0;
+}
+
+int prune_blacklist(prune_t *p, const char *symbol) {
+    if (matcher_is_pattern(symbol))
+        return matcher_add(p->blacklist_patterns, symbol);
+    sym_t sym = symtab_intern(p->symtab, symbol);
+    if (sym == SYM_NONE)
+        return -1;
+    set_insert(p->blacklist, sym);
+    return 0;
+}
+
+int prune_add_attribute(prune_t *p, const char *symbol, const char *attrib) {
+    return add_attribute(p->symtab, p->extra_attributes, symbol, attrib);
+}
+
+int prune_compile_commands(prune_t *p, const char *path) {
+    /* libclang wants the directory containing the database. */
+    char *dir = strdup(path);
+    if (dir == NULL)
+        return -1;
+    struct stat st;
+    const char *build_dir = dir;
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+        build_dir = dirname(dir);
+
+    CXCompilationDatabase_Error err;
+    CXCompilationDatabase db = clang_CompilationDatabase_fromDirectory(
+        build_dir, &err);
+    free(dir);
+    if (err != CXCompilationDatabase_NoError || db == NULL) {
+        fprintf(stderr, "%s: failed to load compilation database\n", path);
+        return -1;
+    }
+
+    if (p->compile_commands != NULL)
+        clang_CompilationDatabase_dispose(p->compile_commands);
+    p->compile_commands = db;
+    return 0;
+}
+
+/* The symbols a CFG defines or declares that are blacklisted, either by name
+ * or by pattern. Each name is tested against the patterns once, however many
+ * times it is declared. Returns NULL on failure.
+ */
+static bitset_t *blacklisted(const prune_t *p, cfg_t *graph) {
+    bitset_t *b = bitset_from_set(p->blacklist);
+    if (b == NULL || matcher_empty(p->blacklist_patterns))
+        return b;
+
+    bitset_t *tested = bitset();
+    if (tested == NULL)
+        goto fail1;
+
+    bool ok = true;
+    void test(sym_t name) {
+        if (name == SYM_NONE || bitset_contains(tested, name))
+            return;
+        if (bitset_insert(tested, name) != 0)
+            ok = false;
+        else if (matcher_match(p->blacklist_patterns,
+                    symtab_name(p->symtab, name)) &&
+                bitset_insert(b, name) != 0)
+            ok = false;
+    }
+    cfg_definitions(graph, test);
+    size_t decls_sz;
+    const cfg_decl_t *decls = cfg_decls(graph, &decls_sz);
+    for (size_t i = 0; i < decls_sz; i++)
+        test(decls[i].name);
+
+    bitset_destroy(tested);
+    if (ok)
+        return b;
+
+fail1: bitset_destroy(b);
+    return NULL;
+}
+
+/* Add the functions and global variables defined in a CFG whose names match a
+ * kept pattern to a set of kept symbols. Returns non-zero on failure.
+ */
+static int add_kept(const prune_t *p, cfg_t *graph, bitset_t *keep) {
+    if (matcher_empty(p->keep_patterns))
+        return 0;
+
+    bool ok = true;
+    void test(sym_t name) {
+        if (!bitset_contains(keep, name) &&
+                matcher_match(p->keep_patterns, symtab_name(p->symtab, name)) &&
+                bitset_insert(keep, name) != 0)
+            ok = false;
+    }
+    cfg_definitions(graph, test);
+    return ok ? 0 : -1;
+}
+
+/* Use the passed CFG to recursively enumerate callees of the passed "to-keep"
+ * symbols and accumulate these. Returns non-zero on failure.
+ */
+static int merge_callees(bitset_t *keeps, cfg_t *graph, symtab_t *symtab,
+        const bitset_t *blacklist, bool globals, const char *input) {
+    int ret = -1;
+
+    /* Unless globals are being pruned themselves, every non-static global
+     * that is not blacklisted will be emitted, so the functions its
+     * initialiser refers to must be retained too. Static globals are reached
+     * from whatever refers to them instead, and emitted only if they are.
+     */
+    bool ok = true;
+    void root(sym_t global) {
+        if (!bitset_contains(blacklist, global) &&
+                bitset_insert(keeps, global) != 0)
+            ok = false;
+    }
+    if (globals)
+        cfg_globals(graph, root);
+    if (!ok)
+        goto fail1;
+
+    /* The roots to traverse from. Callees are inserted straight into the keeps
+     * bitset as we find them, so we take a snapshot of its members first.
+     */
+    sym_t *roots = calloc(bitset_size(keeps) + 1, sizeof(*roots));
+    if (roots == NULL)
+        goto fail1;
+    size_t roots_sz = 0;
+    void add_root(sym_t item) {
+        roots[roots_sz++] = item;
+    }
+    bitset_foreach(keeps, add_root);
+
+    /* Visitor for appending each callee to the "keeps" set. */
+    enum CXChildVisitResult visitor(sym_t callee, sym_t caller, void *_) {
+
+        /* The CFG callee visitation calls us once per undefined function with
+         * SYM_NONE as the callee. This is useful for warning the user when the
+         * input file is incomplete and we may be pruning it too agressively.
+         */
+        if (callee == SYM_NONE) {
+            fprintf(stderr, "%s: Warning: no definition for called function "
+                "%s\n", input, symtab_name(symtab, caller));
+            return CXChildVisit_Continue;
+        }
+
+        if (bitset_contains(keeps, callee))
+            /* Its callees are already being (or have been) visited. */
+            return CXChildVisit_Continue;
+
+        if (bitset_insert(keeps, callee) != 0)
+            return CXChildVisit_Break;
+
+        return CXChildVisit_Recurse;
+    }
+
+    /* Recursion is common and harmless for our purposes, because the
+     * traversal never re-enters a function it has already seen.
+     */
+    void on_cycle(sym_t callee, sym_t caller, void *_) {
+#ifdef DEBUG
+        fprintf(stderr, "%s: Recursive call from %s to %s\n", input,
+            symtab_name(symtab, caller), symtab_name(symtab, callee));
+#endif
+    }
+
+    for (size_t i = 0; i < roots_sz; i++) {
+        if (cfg_visit_callees(graph, roots[i], visitor, on_cycle, NULL) == 1)
+            /* Traversal of this particular caller's callees failed. */
+            goto fail2;
+    }
+    ret = 0;
+
+fail2: free(roots);
+fail1: return ret;
+}
+
+int prune_reach(const prune_t *p, cfg_t *graph, bitset_t *keep, bool globals,
+        const char *name) {
+    bitset_t *blacklist = blacklisted(p, graph);
+    if (blacklist == NULL)
+        return -1;
+    int ret = -1;
+    if (add_kept(p, graph, keep) == 0)
+        ret = merge_callees(keep, graph, p->symtab, blacklist, globals, name);
+    bitset_destroy(blacklist);
+    return ret;
+}
+
+int prune_why(const prune_t *p, cfg_t *graph, bool globals, const char *symbol,
+        FILE *f, const char *name) {
+    int ret = -1;
+
+    /* The same roots as prune_reach starts from. */
+    bitset_t *roots = bitset_from_set(p->keep);
+    if (roots == NULL)
+        goto fail1;
+    if (add_kept(p, graph, roots) != 0)
+        goto fail2;
+    bitset_t *blacklist = blacklisted(p, graph);
+    if (blacklist == NULL)
+        goto fail2;
+    bool ok = true;
+    void root(sym_t global) {
+        if (!bitset_contains(blacklist, global) &&
+                bitset_insert(roots, global) != 0)
+            ok = false;
+    }
+    if (globals)
+        cfg_globals(graph, root);
+    bitset_destroy(blacklist);
+    if (!ok)
+        goto fail2;
+
+    sym_t target = symtab_intern(p->symtab, symbol);
+    if (target == SYM_NONE)
+        goto fail2;
+
+    sym_t *chain;
+    size_t chain_sz;
+    int err = cfg_chain(graph, roots, target, &chain, &chain_sz);
+    if (err < 0)
+        goto fail2;
+
+    /* Keep each answer together when several threads are reporting. */
+    flockfile(f);
+    fprintf(f, "%s: %s: ", name, symbol);
+    if (err > 0) {
+        fprintf(f, "not reachable from any kept function%s\n",
+            globals ? " or global" : "");
+    } else {
+        for (size_t i = 0; i < chain_sz; i++)
+            fprintf(f, "%s%s", i == 0 ? "" : " -> ",
+                symtab_name(p->symtab, chain[i]));
+        fputc('\n', f);
+        free(chain);
+    }
+    funlockfile(f);
+    ret = 0;
+
+fail2: bitset_destroy(roots);
+fail1: if (ret != 0)
+        fprintf(stderr, "%s: failed to determine why %s is retained\n", name,
+            symbol);
+    return ret;
+}
+
+bitset_t *prune_reachable(const prune_t *p, prune_tu_t *unit) {
+    bitset_t *keep = bitset_from_set(p->keep);
+    if (keep == NULL) {
+        fprintf(stderr, "%s: failed to allocate keep set\n", unit->input);
+        return NULL;
+    }
+
+    /* Previous traversals are irrelevant to this one. */
+    cfg_reset(unit->graph);
+
+    stopwatch_t w;
+    stopwatch_start(&w);
+    if (prune_reach(p, unit->graph, keep, !p->prune_decls, unit->input) != 0) {
+        fprintf(stderr, "%s: Failed to traverse CFG\n", unit->input);
+        bitset_destroy(keep);
+        return NULL;
+    }
+    stats_record(&unit->stats, PHASE_REACH, &w);
+
+    return keep;
+}
+
+/* Saved call graphs live next to their input file, with this appended. */
+#define GRAPH_CACHE_SUFFIX ".prune-cfg"
+
+static void free_args(char **args, size_t args_sz) {
+    for (size_t i = 0; i < args_sz; i++)
+        free(args[i]);
+    free(args);
+}
+
+/* Determine the arguments to parse an input file with: its command from the
+ * compilation database if it has one, and otherwise those to tell Clang it is
+ * C, followed by the extra arguments. Returns a malloced array to be released
+ * with free_args, or NULL on failure.
+ */
+static char **compile_args(const prune_t *p, const char *input,
+        size_t *args_sz) {
+    CXCompileCommands cmds = NULL;
+    CXCompileCommand cmd = NULL;
+    unsigned cmd_args = 0;
+    if (p->compile_commands != NULL) {
+        cmds = clang_CompilationDatabase_getCompileCommands(p->compile_commands,
+            input);
+        if (cmds != NULL && clang_CompileCommands_getSize(cmds) > 0) {
+            cmd = clang_CompileCommands_getCommand(cmds, 0);
+            cmd_args = clang_CompileCommand_getNumArgs(cmd);
+        } else {
+            fprintf(stderr, "%s: Warning: no compile command found; parsing "
+                "as plain C\n", input);
+        }
+    }
+
+    /* The command's arguments stand in for "-x c", but we add
+     * "-working-directory dir" to them. Either way, "-include-pch pch" may
+     * follow.
+     */
+    size_t n = 0;
+    char **args = calloc(cmd_args + 4 + p->args_sz, sizeof(*args));
+    bool ok = args != NULL;
+    void add(const char *arg) {
+        if (ok && (args[n] = strdup(arg)) != NULL)
+            n++;
+        else
+            ok = false;
+    }
+
+    if (cmd != NULL) {
+        CXString dir = clang_CompileCommand_getDirectory(cmd);
+        CXString file = clang_CompileCommand_getFilename(cmd);
+        add("-working-directory");
+        add(clang_getCString(dir));
+
+        /* Skip the compiler itself, and the input, which we pass separately.
+         */
+        for (unsigned i = 1; i < cmd_args; i++) {
+            CXString arg = clang_CompileCommand_getArg(cmd, i);
+            const char *a = clang_getCString(arg);
+            if (strcmp(a, clang_getCString(file)) != 0 && strcmp(a, input) != 0)
+                add(a);
+            clang_disposeString(arg);
+        }
+        clang_disposeString(file);
+        clang_disposeString(dir);
+    } else {
+        add("-x");
+        add("c");
+    }
+    if (cmds != NULL)
+        clang_CompileCommands_dispose(cmds);
+
+    if (p->pch != NULL) {
+        add("-include-pch");
+        add(p->pch);
+    }
+
+    for (size_t i = 0; i < p->args_sz; i++)
+        add(p->args[i]);
+
+    if (!ok) {
+        if (args != NULL)
+            free_args(args, n);
+        return NULL;
+    }
+    *args_sz = n;
+    return args;
+}
+
+/* Standard input is parsed under this name, as libclang needs one for it. */
+#define STDIN_NAME "<stdin>"
+
+/* The name libclang knows an input file by. */
+static const char *parse_name(const char *input) {
+    return strcmp(input, "-") ? input : STDIN_NAME;
+}
+
+/* Read a unit's input file (or standard input) once, for both libclang and
+ * emission to use. Returns non-zero on failure.
+ */
+static int map_input(prune_tu_t *unit) {
+    unit->source = strcmp(unit->input, "-") ? source(unit->input) :
+        source_fd(STDIN_FILENO);
+    if (unit->source == NULL) {
+        fprintf(stderr, "%s: input file does not exist or is unreadable: %s\n",
+            unit->input, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* The contents of a unit's input, as libclang should see them. */
+static struct CXUnsavedFile unsaved(const prune_tu_t *unit) {
+    return (struct CXUnsavedFile){
+        .Filename = parse_name(unit->input),
+        .Contents = unit->source->data == NULL ? "" : unit->source->data,
+        .Length = unit->source->size,
+    };
+}
+
+int prune_load(const prune_t *p, CXIndex index, prune_tu_t *unit) {
+    const char *input = unit->input;
+
+    if (map_input(unit) != 0)
+        return -1;
+
+    size_t args_sz;
+    char **args = compile_args(p, input, &args_sz);
+    if (args == NULL) {
+        fprintf(stderr, "%s: failed to determine compiler arguments\n", input);
+        source_destroy(unit->source);
+        unit->source = NULL;
+        return -1;
+    }
+
+    /* Function bodies are all we skip; detailed preprocessing records are
+     * already off by default.
+     */
+    unsigned int flags = CXTranslationUnit_None;
+    if (p->skip_bodies)
+        flags |= CXTranslationUnit_SkipFunctionBodies |
+            CXTranslationUnit_Incomplete;
+    if (p->preamble)
+        flags |= CXTranslationUnit_PrecompiledPreamble |
+            CXTranslationUnit_CreatePreambleOnFirstParse;
+
+    /* Cache entries are keyed on everything that affects parsing. */
+    char *key = NULL;
+    if (p->cache_dir != NULL || p->graph_cache) {
+        key = cache_key(input, unit->source, (const char *const*)args,
+            args_sz, flags);
+        if (key == NULL)
+            fprintf(stderr, "%s: Warning: failed to compute cache key: %s\n",
+                input, strerror(errno));
+    }
+
+    stopwatch_t w;
+    stopwatch_start(&w);
+
+    /* If the user gave us a cache, try to load an existing parse of this
+     * exact input from it.
+     */
+    char *cached = NULL;
+    if (p->cache_dir != NULL && key != NULL) {
+        cached = cache_path(p->cache_dir, key, ".ast");
+        if (cached == NULL)
+            fprintf(stderr, "%s: Warning: failed to determine cache entry: %s\n",
+                input, strerror(errno));
+        else
+            unit->tu = cache_load_tu(index, cached);
+    }
+
+    if (unit->tu == NULL) {
+        /* Parse the source file into a translation unit, from the contents
+         * we have already read rather than having libclang read it again.
+         */
+        struct CXUnsavedFile contents = unsaved(unit);
+        unit->tu = clang_parseTranslationUnit(index, parse_name(input),
+            (const char *const*)args, args_sz, &contents, 1, flags);
+        if (unit->tu == NULL) {
+            fprintf(stderr, "%s: failed to parse source file\n", input);
+            free(cached);
+            free(key);
+            free_args(args, args_sz);
+            source_destroy(unit->source);
+            unit->source = NULL;
+            return -1;
+        }
+
+        if (cached != NULL && cache_save_tu(unit->tu, cached) != 0)
+            fprintf(stderr, "%s: Warning: failed to save %s\n", input, cached);
+    }
+    free(cached);
+    free_args(args, args_sz);
+    stats_record(&unit->stats, PHASE_PARSE, &w);
+    stopwatch_start(&w);
+
+    /* If there is a saved call graph for this exact input next to it, we only
+     * need to find the top-level declarations here and can take the call
+     * edges from the saved graph.
+     */
+    char *graph_path = NULL;
+    if (p->graph_cache && key != NULL && strcmp(input, "-")) {
+        graph_path = malloc(strlen(input) + strlen(GRAPH_CACHE_SUFFIX) + 1);
+        if (graph_path != NULL) {
+            strcpy(graph_path, input);
+            strcat(graph_path, GRAPH_CACHE_SUFFIX);
+            unit->graph = cfg(unit->tu,
+                p->cfg_mode == CFG_TOKENS ? CFG_TOKENS : CFG_LAZY,
+                p->symtab);
+            if (unit->graph != NULL &&
+                    cache_load_cfg(unit->graph, graph_path, key) != 0) {
+                cfg_destroy(unit->graph);
+                unit->graph = NULL;
+            } else if (unit->graph != NULL) {
+                /* No need to save what we just loaded. */
+                free(graph_path);
+                graph_path = NULL;
+            }
+        }
+    }
+
+    if (unit->graph == NULL) {
+        /* Derive the Control Flow Graph of the TU. We then use this CFG to
+         * expand the kept symbols set to include callees of the kept symbols.
+         * If we're going to save the graph, there's no point doing so lazily
+         * (unless we have no bodies to be eager about).
+         */
+        cfg_mode_t mode = p->cfg_mode;
+        if (graph_path != NULL && mode == CFG_LAZY)
+            mode = CFG_EAGER;
+        errno = 0;
+        unit->graph = cfg(unit->tu, mode, p->symtab);
+        if (unit->graph == NULL) {
+            if (errno != 0) {
+                fprintf(stderr, "%s: failed to form CFG: %s\n", input,
+                    strerror(errno));
+            } else {
+                fprintf(stderr, "%s: failed to form CFG\n", input);
+            }
+            free(graph_path);
+            free(key);
+            return -1;
+        }
+
+        if (graph_path != NULL &&
+                cache_save_cfg(unit->graph, graph_path, key) != 0)
+            fprintf(stderr, "%s: Warning: failed to save %s\n", input,
+                graph_path);
+    }
+    free(graph_path);
+    free(key);
+    stats_record(&unit->stats, PHASE_CFG, &w);
+
+    return 0;
+}
+
+int prune_build_pch(const prune_t *p, CXIndex index, const char *header,
+        const char *pch) {
+    int ret = -1;
+
+    /* Function bodies in headers are rare enough that we don't bother
+     * skipping them here.
+     */
+    const char **args = calloc(2 + p->args_sz, sizeof(*args));
+    if (args == NULL) {
+        fprintf(stderr, "%s: failed to allocate arguments\n", header);
+        goto fail1;
+    }
+    args[0] = "-x";
+    args[1] = "c-header";
+    for (size_t i = 0; i < p->args_sz; i++)
+        args[2 + i] = p->args[i];
+
+    CXTranslationUnit tu = clang_parseTranslationUnit(index, header, args,
+        2 + p->args_sz, NULL, 0, CXTranslationUnit_ForSerialization |
+        CXTranslationUnit_Incomplete);
+    if (tu == NULL) {
+        fprintf(stderr, "%s: failed to parse header\n", header);
+        goto fail2;
+    }
+
+    if (cache_save_tu(tu, pch) != 0) {
+        fprintf(stderr, "%s: failed to save %s\n", header, pch);
+        goto fail3;
+    }
+
+    ret = 0;
+
+fail3: clang_disposeTranslationUnit(tu);
+fail2: free(args);
+fail1: return ret;
+}
+
+int prune_attach(const prune_t *p, CXTranslationUnit tu, prune_tu_t *unit) {
+    if (map_input(unit) != 0)
+        return -1;
+    unit->tu = tu;
+    unit->borrowed = true;
+
+    stopwatch_t w;
+    stopwatch_start(&w);
+    errno = 0;
+    unit->graph = cfg(tu, p->cfg_mode, p->symtab);
+    if (unit->graph == NULL) {
+        fprintf(stderr, "%s: failed to form CFG%s%s\n", unit->input,
+            errno != 0 ? ": " : "", errno != 0 ? strerror(errno) : "");
+        unit->tu = NULL;
+        unit->borrowed = false;
+        source_destroy(unit->source);
+        unit->source = NULL;
+        return -1;
+    }
+    stats_record(&unit->stats, PHASE_CFG, &w);
+
+    return 0;
+}
+
+int prune_reparse(const prune_t *p, prune_tu_t *unit) {
+    /* The cursors in the CFG are invalidated by reparsing. */
+    if (unit->graph != NULL)
+        cfg_destroy(unit->graph);
+    unit->graph = NULL;
+
+    source_t *previous = unit->source;
+    if (map_input(unit) != 0) {
+        unit->source = previous;
+        return -1;
+    }
+    source_destroy(previous);
+
+    stopwatch_t w;
+    stopwatch_start(&w);
+    struct CXUnsavedFile contents = unsaved(unit);
+    if (clang_reparseTranslationUnit(unit->tu, 1, &contents,
+            clang_defaultReparseOptions(unit->tu)) != 0)
+        return -1;
+    stats_record(&unit->stats, PHASE_PARSE, &w);
+
+    stopwatch_start(&w);
+    unit->graph = cfg(unit->tu, p->cfg_mode, p->symtab);
+    if (unit->graph == NULL)
+        return -1;
+    stats_record(&unit->stats, PHASE_CFG, &w);
+    return 0;
+}
+
+void prune_unload(prune_tu_t *unit) {
+    if (unit->graph != NULL) {
+        unsigned long functions, edges;
+        cfg_count(unit->graph, &functions, &edges);
+        unit->stats.functions += functions;
+        unit->stats.edges += edges;
+        cfg_destroy(unit->graph);
+    }
+    unit->graph = NULL;
+    if (unit->emitted != NULL)
+        dict_destroy(unit->emitted);
+    unit->emitted = NULL;
+    if (unit->tu != NULL && !unit->borrowed)
+        clang_disposeTranslationUnit(unit->tu);
+    unit->tu = NULL;
+    unit->borrowed = false;
+    if (unit->source != NULL)
+        source_destroy(unit->source);
+    unit->source = NULL;
+}
+
+int prune_emit(const prune_t *p, prune_tu_t *unit, bitset_t *keep,
+        sink_t *sink) {
+    int ret = -1;
+
+    /* Output is composed directly in an in-memory sink's buffer, and otherwise
+     * accumulated and written to the sink in chunks, possibly in the
+     * background.
+     */
+
+    /* Resolve any blacklisted patterns against this unit up front, so each
+     * declaration is then a single lookup.
+     */
+    bitset_t *blacklist = blacklisted(p, unit->graph);
+    if (blacklist == NULL) {
+        fprintf(stderr, "%s: failed to determine blacklisted declarations\n",
+            unit->input);
+        goto fail1;
+    }
+
+    buf_t *out = sink_buffer(sink);
+    bool staged = out == NULL;
+    if (staged) {
+        out = buf(OUTPUT_CHUNK * 2);
+        if (out == NULL) {
+            fprintf(stderr, "%s: failed to allocate output buffer\n",
+                unit->input);
+            goto fail2;
+        }
+    }
+
+    state_t st = {
+        .symtab = p->symtab,
+        .keep = keep,
+        .blacklist = blacklist,
+        .extra_attributes = p->extra_attributes,
+        .tu = &unit->tu,
+        .source = unit->source,
+        .file = clang_getFile(unit->tu, parse_name(unit->input)),
+        .buf = out,
+        .out = staged ? sink : NULL,
+        .verbatim = p->verbatim,
+        .compact = p->compact,
+        .stats = &unit->stats,
+        .previous = unit->emitted,
+    };
+
+    if (p->incremental) {
+        st.emitted = dict(memo_destroy);
+        if (st.emitted == NULL) {
+            fprintf(stderr, "%s: failed to allocate output memo\n",
+                unit->input);
+            goto fail3;
+        }
+    }
+
+    /* Work out which declarations the retained functions need, if we are
+     * pruning more than just functions.
+     */
+    bool *needed = NULL;
+    if (p->prune_decls) {
+        needed = cfg_needed(unit->graph, keep, blacklist);
+        if (needed == NULL) {
+            fprintf(stderr, "%s: failed to determine needed declarations\n",
+                unit->input);
+            goto fail4;
+        }
+    }
+
+    /* Writing in the background is only an optimisation, so we fall back to
+     * writing as we go if the writer cannot be started.
+     */
+    writer_t writer;
+    if (staged && p->background_writes && writer_start(&writer, sink, out) == 0)
+        st.writer = &writer;
+
+    /* Now emit the top-level declarations the CFG collected, rather than
+     * traversing the AST again.
+     */
+    size_t decls_sz;
+    const cfg_decl_t *decls = cfg_decls(unit->graph, &decls_sz);
+    for (size_t i = 0; i < decls_sz; i++)
+        visitor(&decls[i], needed == NULL ? NULL : &needed[i], &st);
+
+    /* Each failure's errno is saved as it happens, as whatever we call after
+     * it may change errno.
+     */
+    int err = st.err;
+    if (st.writer != NULL) {
+        int written = writer_finish(&writer, st.buf);
+        if (err == 0)
+            err = written;
+    } else if (err == 0 && staged && sink_flush(sink, out) != 0) {
+        err = errno != 0 ? errno : EIO;
+    }
+    if (err != 0) {
+        fprintf(stderr, "%s: failed to write output: %s\n", unit->input,
+            strerror(err));
+        goto fail5;
+    }
+
+    /* What we emitted this time is what the next emission can reuse. */
+    if (st.emitted != NULL) {
+        if (unit->emitted != NULL)
+            dict_destroy(unit->emitted);
+        unit->emitted = st.emitted;
+        st.emitted = NULL;
+    }
+
+    ret = 0;
+
+fail5: free(needed);
+fail4: if (st.emitted != NULL)
+        dict_destroy(st.emitted);
+fail3: if (staged)
+        buf_destroy(out);
+fail2: bitset_destroy(blacklist);
+fail1: return ret;
+}
+
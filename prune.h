@@ -0,0 +1,188 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#ifndef _PRUNE_H_
+#define _PRUNE_H_
+
+/* Library interface to pruning, for use without exec'ing the prune tool (e.g.
+ * to keep translation units loaded in-process). Typical use is:
+ *
+ *   prune_t *p = prune();
+ *   prune_keep(p, "main");
+ *   prune_tu_t unit = { .input = "foo.c" };
+ *   prune_load(p, index, &unit);
+ *   bitset_t *keep = prune_reachable(p, &unit);
+ *   prune_emit(p, &unit, keep, sink);
+ *   bitset_destroy(keep);
+ *   prune_unload(&unit);
+ *   prune_destroy(p);
+ *
+ * Errors are reported on stderr, prefixed with the input file's name.
+ */
+
+#include "bitset.h"
+#include "cfg.h"
+#include <clang-c/CXCompilationDatabase.h>
+#include <clang-c/Index.h> /* -lclang */
+#include "dict.h"
+#include "match.h"
+#include "set.h"
+#include "sink.h"
+#include "source.h"
+#include "stats.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include "symtab.h"
+
+/* Settings and symbols that apply to everything pruned in one context. The
+ * fields may be changed directly between operations.
+ */
+typedef struct {
+    symtab_t *symtab;
+    set_t *keep;                /* functions to retain, with their callees */
+    set_t *blacklist;           /* declarations never to emit */
+    matcher_t *keep_patterns;   /* functions to retain, by pattern */
+    matcher_t *blacklist_patterns; /* declarations never to emit, by
+                                    * pattern */
+    dict_t *extra_attributes;   /* symbol -> set of attributes to add */
+    cfg_mode_t cfg_mode;
+    bool skip_bodies;           /* parse without function bodies */
+    bool prune_decls;           /* prune types and globals too */
+    bool verbatim;              /* copy declarations with their formatting */
+    bool compact;               /* otherwise, separate tokens by spaces only
+                                 * where necessary, rather than newlines */
+    const char *cache_dir;      /* where to cache parses, or NULL */
+    bool graph_cache;           /* save call graphs next to their inputs */
+    const char *const *args;    /* extra arguments to pass to Clang */
+    size_t args_sz;
+    CXCompilationDatabase compile_commands; /* where to find each input's
+                                             * arguments, or NULL */
+    const char *pch;            /* precompiled header to include, or NULL */
+    bool preamble;              /* precompile each input's preamble, to
+                                 * speed up reparsing */
+    bool incremental;           /* keep each unit's output, so the next
+                                 * prune_emit of it only emits declarations
+                                 * whose text has changed */
+    bool background_writes;     /* in prune_emit, write output to the sink
+                                 * from a second thread */
+    bool shared;                /* symtab and compile_commands belong to
+                                 * another context */
+} prune_t;
+
+/* Create a context with default settings and nothing kept, blacklisted or
+ * annotated. Returns NULL on failure.
+ */
+prune_t *prune(void);
+
+/* Create a context with the same settings as another and its own copies of
+ * the kept, blacklisted and annotated symbols, which can then be changed
+ * independently. The symbol table is shared, so this context must not outlive
+ * the original. Returns NULL on failure.
+ */
+prune_t *prune_copy(const prune_t *p);
+
+void prune_destroy(prune_t *p);
+
+/* Precompile a header, for inputs that share it to use as p->pch rather than
+ * each parsing it from scratch. The header is parsed as C with the extra
+ * arguments in args, which should match those the inputs are parsed with.
+ * Returns non-zero on failure.
+ */
+int prune_build_pch(const prune_t *p, CXIndex index, const char *header,
+    const char *pch);
+
+/* Add a symbol to those kept or blacklisted, or annotate a symbol with an
+ * extra GCC attribute. A symbol to keep or blacklist may also be a pattern (see
+ * match.h), which applies to every function or global variable defined in an
+ * input whose name it matches and, for the blacklist, every other top-level
+ * declaration too. Returns non-zero on failure, including for an invalid
+ * pattern (with errno set to EINVAL).
+ */
+int prune_keep(prune_t *p, const char *symbol);
+int prune_blacklist(prune_t *p, const char *symbol);
+int prune_add_attribute(prune_t *p, const char *symbol, const char *attrib);
+
+/* Parse inputs with their commands from the compile_commands.json in a given
+ * build directory (or at a given path), rather than as plain C. Inputs with no
+ * command in the database are still parsed as plain C. Either way, the extra
+ * arguments in args follow. Returns non-zero on failure.
+ */
+int prune_compile_commands(prune_t *p, const char *path);
+
+/* A translation unit to prune. Callers fill in input, the path of its main
+ * file (or "-" for standard input), and leave the rest zeroed before loading
+ * it.
+ */
+typedef struct {
+    const char *input;
+    source_t *source;           /* the input's contents, read once */
+    CXTranslationUnit tu;
+    bool borrowed;              /* tu belongs to the caller */
+    cfg_t *graph;
+    dict_t *emitted;            /* output of the last prune_emit, if
+                                 * incremental */
+    stats_t stats;              /* accumulated over every operation */
+} prune_tu_t;
+
+/* Parse a translation unit's input file (or fetch it from the cache) and
+ * derive its CFG. The input is mapped once and handed to libclang from memory,
+ * and its mapping reused when emitting. The index may be shared with other
+ * threads loading other translation units. Returns non-zero on failure.
+ */
+int prune_load(const prune_t *p, CXIndex index, prune_tu_t *unit);
+
+/* Bring a loaded translation unit up to date with its input file's current
+ * contents by reparsing it, and derive its CFG afresh. Returns non-zero on
+ * failure, in which case the unit should be unloaded and loaded again.
+ */
+int prune_reparse(const prune_t *p, prune_tu_t *unit);
+
+/* Adopt an existing translation unit, parsed from unit->input, and derive its
+ * CFG. The translation unit remains the caller's, and must outlive the unit.
+ * Returns non-zero on failure.
+ */
+int prune_attach(const prune_t *p, CXTranslationUnit tu, prune_tu_t *unit);
+
+/* Release the resources of a loaded translation unit. */
+void prune_unload(prune_tu_t *unit);
+
+/* Expand a set of kept symbols, with the definitions in a CFG that match the
+ * context's kept patterns, to include everything reachable from them in the
+ * CFG (and, if globals is set, from every non-static global variable not
+ * blacklisted). Name identifies the CFG in warnings. Returns non-zero on
+ * failure.
+ */
+int prune_reach(const prune_t *p, cfg_t *graph, bitset_t *keep, bool globals,
+    const char *name);
+
+/* Explain why a symbol would be retained, by writing a shortest chain of
+ * calls leading to it from one of the roots prune_reach starts from (with the
+ * same globals setting), or that there is none. Name identifies the CFG in the
+ * output. Returns non-zero on failure.
+ */
+int prune_why(const prune_t *p, cfg_t *graph, bool globals, const char *symbol,
+    FILE *f, const char *name);
+
+/* Determine the symbols to retain in a loaded translation unit: the context's
+ * kept symbols and everything reachable from them. Traversal starts afresh,
+ * so this can be called repeatedly with different settings. Returns a bitset the
+ * caller must destroy, or NULL on failure.
+ */
+bitset_t *prune_reachable(const prune_t *p, prune_tu_t *unit);
+
+/* Emit the declarations of a loaded translation unit that should be retained,
+ * given the symbols to retain (e.g. from prune_reachable), to a sink. The
+ * caller remains responsible for closing the sink. Returns non-zero on
+ * failure.
+ */
+int prune_emit(const prune_t *p, prune_tu_t *unit, bitset_t *keep,
+    sink_t *sink);
+
+#endif
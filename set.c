@@ -13,27 +13,49 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include "symtab.h"
 
 set_t *set(void) {
-    return g_hash_table_new(g_str_hash, g_str_equal);
+    return g_hash_table_new(g_direct_hash, g_direct_equal);
 }
 
-void set_insert(set_t *s, const char *item) {
-    g_hash_table_add(s, (gpointer)item);
+void set_insert(set_t *s, sym_t item) {
+    g_hash_table_add(s, GUINT_TO_POINTER(item));
 }
 
-bool set_contains(set_t *s, const char *item) {
-    return (bool)g_hash_table_contains(s, item);
+bool set_contains(set_t *s, sym_t item) {
+    return (bool)g_hash_table_contains(s, GUINT_TO_POINTER(item));
+}
+
+unsigned int set_size(set_t *s) {
+    return g_hash_table_size(s);
+}
+
+set_t *set_copy(set_t *s) {
+    set_t *copy = set();
+    if (copy == NULL)
+        return NULL;
+    GHashTableIter i;
+    g_hash_table_iter_init(&i, s);
+    gpointer entry;
+    while (g_hash_table_iter_next(&i, &entry, NULL))
+        g_hash_table_add(copy, entry);
+    return copy;
 }
 
 void set_union(set_t *a, set_t *b) {
     GHashTableIter i;
     g_hash_table_iter_init(&i, b);
-    const char *entry;
-    while (g_hash_table_iter_next(&i, (void**)&entry, NULL))
-        g_hash_table_add(a, (gpointer)entry);
+    gpointer entry;
+    while (g_hash_table_iter_next(&i, &entry, NULL))
+        g_hash_table_add(a, entry);
     g_hash_table_destroy(b);
 }
+
+void set_clear(set_t *s) {
+    g_hash_table_remove_all(s);
+}
+
 void set_destroy(set_t *s) {
     g_hash_table_destroy(s);
 }
@@ -42,17 +64,17 @@ void set_iter(set_t *s, set_iter_t *i) {
     g_hash_table_iter_init(i, s);
 }
 
-const char *set_iter_next(set_iter_t *i) {
-    const char *item;
-    if (!g_hash_table_iter_next(i, (void**)&item, NULL))
-        return NULL;
-    return item;
+sym_t set_iter_next(set_iter_t *i) {
+    gpointer item;
+    if (!g_hash_table_iter_next(i, &item, NULL))
+        return SYM_NONE;
+    return GPOINTER_TO_UINT(item);
 }
 
-void set_foreach(set_t *s, void (*f)(void *value)) {
-    void f_wrapper(void *key __attribute__((unused)), void *value,
+void set_foreach(set_t *s, void (*f)(sym_t item)) {
+    void f_wrapper(void *key, void *value __attribute__((unused)),
             void *user_data __attribute__((unused))) {
-        f(value);
+        f(GPOINTER_TO_UINT(key));
     }
     g_hash_table_foreach(s, f_wrapper, NULL);
 }
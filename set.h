@@ -11,22 +11,27 @@
 #ifndef _SET_H_
 #define _SET_H_
 
-/* Implementation of a set. */
+/* Implementation of a set of symbols (see symtab.h). */
 
 #include <glib.h>
 #include <stdbool.h>
+#include "symtab.h"
 
 typedef GHashTable set_t;
 set_t *set(void);
-void set_insert(set_t *s, const char *item);
-bool set_contains(set_t *s, const char *item);
+void set_insert(set_t *s, sym_t item);
+bool set_contains(set_t *s, sym_t item);
+unsigned int set_size(set_t *s);
+set_t *set_copy(set_t *s);
 void set_union(set_t *a, set_t *b);
+void set_clear(set_t *s);
 void set_destroy(set_t *s);
 
 typedef GHashTableIter set_iter_t;
 void set_iter(set_t *s, set_iter_t *i);
-const char *set_iter_next(set_iter_t *i);
+/* Returns SYM_NONE when the iterator is exhausted. */
+sym_t set_iter_next(set_iter_t *i);
 
-void set_foreach(set_t *s, void (*f)(void *value));
+void set_foreach(set_t *s, void (*f)(sym_t item));
 
 #endif
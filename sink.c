@@ -0,0 +1,193 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#include "buf.h"
+#include <errno.h>
+#include <fcntl.h>
+#include "sink.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef enum {
+    SINK_FD,
+    SINK_MMAP,
+    SINK_MEMORY,
+} sink_kind_t;
+
+struct sink {
+    sink_kind_t kind;
+    int fd;
+    bool owned;         /* whether we should close fd */
+    char *map;          /* SINK_MMAP: the mapping */
+    size_t size;        /* SINK_MMAP: bytes written */
+    size_t capacity;    /* SINK_MMAP: size of the file and mapping */
+    buf_t *buf;         /* SINK_MEMORY: where to append */
+};
+
+/* Smallest mapping we bother with. */
+#define MIN_MAPPING 65536
+
+/* Size the file and map it. Returns non-zero on failure. */
+static int map(sink_t *s, size_t capacity) {
+    if (ftruncate(s->fd, (off_t)capacity) != 0)
+        return -1;
+    void *p = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd,
+        0);
+    if (p == MAP_FAILED)
+        return -1;
+    s->map = p;
+    s->capacity = capacity;
+    return 0;
+}
+
+sink_t *sink_file(const char *path, size_t size_hint) {
+    sink_t *s = calloc(1, sizeof(*s));
+    if (s == NULL)
+        return NULL;
+
+    s->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (s->fd < 0 && errno == EACCES)
+        /* Mapping the file needs read access too, but write(2) does not. */
+        s->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (s->fd < 0)
+        goto fail1;
+    s->owned = true;
+
+    struct stat st;
+    if (fstat(s->fd, &st) != 0)
+        goto fail2;
+
+    s->kind = SINK_FD;
+    if (S_ISREG(st.st_mode)) {
+        size_t capacity = size_hint < MIN_MAPPING ? MIN_MAPPING : size_hint;
+        if (map(s, capacity) == 0)
+            s->kind = SINK_MMAP;
+        else if (ftruncate(s->fd, 0) != 0)
+            goto fail2;
+        /* Otherwise, e.g. if opened write-only, fall back to write(2). */
+    }
+
+    return s;
+
+fail2:;
+    int saved = errno;
+    close(s->fd);
+    errno = saved;
+fail1: free(s);
+    return NULL;
+}
+
+sink_t *sink_fd(int fd) {
+    sink_t *s = calloc(1, sizeof(*s));
+    if (s == NULL)
+        return NULL;
+    s->kind = SINK_FD;
+    s->fd = fd;
+    return s;
+}
+
+sink_t *sink_memory(buf_t *b) {
+    sink_t *s = calloc(1, sizeof(*s));
+    if (s == NULL)
+        return NULL;
+    s->kind = SINK_MEMORY;
+    s->fd = -1;
+    s->buf = b;
+    return s;
+}
+
+buf_t *sink_buffer(sink_t *s) {
+    return s->kind == SINK_MEMORY ? s->buf : NULL;
+}
+
+/* Write all of some data to a file descriptor. Returns non-zero on failure. */
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+    return 0;
+}
+
+int sink_write(sink_t *s, const char *data, size_t len) {
+    switch (s->kind) {
+
+        case SINK_FD:
+            return write_all(s->fd, data, len);
+
+        case SINK_MMAP:
+            if (s->map == NULL)
+                /* We failed to grow the mapping earlier. */
+                return -1;
+            if (s->capacity - s->size < len) {
+                /* Our guess at the size of the output was too small. */
+                size_t capacity = s->capacity * 2;
+                while (capacity - s->size < len)
+                    capacity *= 2;
+                munmap(s->map, s->capacity);
+                s->map = NULL;
+                if (map(s, capacity) != 0)
+                    return -1;
+            }
+            memcpy(s->map + s->size, data, len);
+            s->size += len;
+            return 0;
+
+        case SINK_MEMORY:
+            if (s->buf == NULL || buf_append(s->buf, data, len) != 0) {
+                errno = ENOMEM;
+                return -1;
+            }
+            return 0;
+    }
+
+    return -1;
+}
+
+int sink_flush(sink_t *s, buf_t *b) {
+    if (b->size > 0 && sink_write(s, b->data, b->size) != 0)
+        return -1;
+    buf_reset(b);
+    return 0;
+}
+
+int sink_close(sink_t *s) {
+    int ret = 0;
+
+    if (s->kind == SINK_MMAP) {
+        if (s->map != NULL && munmap(s->map, s->capacity) != 0)
+            ret = -1;
+        /* Drop the excess we preallocated. */
+        if (ftruncate(s->fd, (off_t)s->size) != 0)
+            ret = -1;
+    }
+
+    if (s->owned) {
+        int saved = errno;
+        if (close(s->fd) != 0)
+            ret = -1;
+        else if (ret != 0)
+            errno = saved;
+    }
+
+    free(s);
+    return ret;
+}
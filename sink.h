@@ -0,0 +1,59 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#ifndef _SINK_H_
+#define _SINK_H_
+
+/* Destinations for output. Output is accumulated in a buf_t and handed to a
+ * sink in large chunks, so none of the backends go through stdio.
+ */
+
+#include "buf.h"
+#include <stddef.h>
+
+typedef struct sink sink_t;
+
+/* Open a file for writing, replacing its contents. A regular file is written
+ * through a shared mapping, preallocated to size_hint bytes and grown as
+ * necessary, and truncated to the length of the output when the sink is
+ * closed. Anything else (e.g. a pipe or terminal) is written to directly with
+ * write(2). Returns NULL on failure, with errno set.
+ */
+sink_t *sink_file(const char *path, size_t size_hint);
+
+/* A sink writing to an already open file descriptor with write(2). The
+ * descriptor is not closed with the sink. Returns NULL on failure.
+ */
+sink_t *sink_fd(int fd);
+
+/* A sink appending to a buffer in memory, which the caller retains ownership
+ * of. Returns NULL on failure.
+ */
+sink_t *sink_memory(buf_t *b);
+
+/* If a sink is in memory, the buffer it appends to, so output can be composed
+ * in place rather than copied there. Otherwise NULL.
+ */
+buf_t *sink_buffer(sink_t *s);
+
+/* Write data to a sink. Returns non-zero on failure, with errno set. */
+int sink_write(sink_t *s, const char *data, size_t len);
+
+/* Write the contents of a buffer to a sink and empty it. Returns non-zero on
+ * failure, with errno set.
+ */
+int sink_flush(sink_t *s, buf_t *b);
+
+/* Finish writing to a sink and deallocate it. Returns non-zero if any output
+ * could not be written, with errno set.
+ */
+int sink_close(sink_t *s);
+
+#endif
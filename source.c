@@ -0,0 +1,102 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include "source.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Read the rest of a file into memory. Returns non-zero on failure. */
+static int slurp(source_t *s, int fd) {
+    size_t cap = 0;
+    char *data = NULL;
+    for (;;) {
+        if (s->size == cap) {
+            cap = cap == 0 ? 64 * 1024 : cap * 2;
+            char *p = realloc(data, cap);
+            if (p == NULL)
+                goto fail;
+            data = p;
+        }
+        ssize_t r = read(fd, data + s->size, cap - s->size);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            goto fail;
+        if (r == 0)
+            break;
+        s->size += (size_t)r;
+    }
+    s->data = data;
+    s->allocated = true;
+    return 0;
+
+fail:;
+    int saved = errno;
+    free(data);
+    s->size = 0;
+    errno = saved;
+    return -1;
+}
+
+source_t *source_fd(int fd) {
+    source_t *s = calloc(1, sizeof(*s));
+    if (s == NULL)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        goto fail1;
+
+    if (!S_ISREG(st.st_mode)) {
+        if (slurp(s, fd) != 0)
+            goto fail1;
+        return s;
+    }
+
+    s->size = (size_t)st.st_size;
+    if (s->size > 0) {
+        /* mmap rejects zero-length mappings, so an empty file is left with
+         * NULL data.
+         */
+        void *p = mmap(NULL, s->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+            goto fail1;
+        s->data = p;
+    }
+    return s;
+
+fail1: free(s);
+    return NULL;
+}
+
+source_t *source(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    source_t *s = source_fd(fd);
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return s;
+}
+
+void source_destroy(source_t *s) {
+    if (s->allocated)
+        free((void*)s->data);
+    else if (s->data != NULL)
+        munmap((void*)s->data, s->size);
+    free(s);
+}
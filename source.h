@@ -0,0 +1,40 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#ifndef _SOURCE_H_
+#define _SOURCE_H_
+
+/* Read-only, memory-mapped view of an input file. This lets us copy token
+ * text directly out of the source rather than asking libclang to spell it,
+ * and hand libclang the same bytes to parse rather than having it read the
+ * file again.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+    const char *data;
+    size_t size;
+    bool allocated;     /* data was read into memory rather than mapped */
+} source_t;
+
+/* Returns NULL on failure, with errno set. */
+source_t *source(const char *path);
+
+/* The contents of an already open file descriptor, which is not closed. A
+ * regular file is mapped as for source, and anything else (e.g. a pipe) is
+ * read to its end. Returns NULL on failure, with errno set.
+ */
+source_t *source_fd(int fd);
+
+void source_destroy(source_t *s);
+
+#endif
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#include "stats.h"
+#include <stdio.h>
+#include <sys/resource.h>
+#include <time.h>
+
+void stopwatch_start(stopwatch_t *w) {
+    clock_gettime(CLOCK_MONOTONIC, &w->wall);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &w->cpu);
+}
+
+static double elapsed(const struct timespec *start, const struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+        (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void stats_record(stats_t *s, phase_t phase, const stopwatch_t *w) {
+    stopwatch_t now;
+    stopwatch_start(&now);
+    s->wall[phase] += elapsed(&w->wall, &now.wall);
+    s->cpu[phase] += elapsed(&w->cpu, &now.cpu);
+}
+
+void stats_add(stats_t *total, const stats_t *s) {
+    for (unsigned int i = 0; i < PHASE_COUNT; i++) {
+        total->wall[i] += s->wall[i];
+        total->cpu[i] += s->cpu[i];
+    }
+    total->functions += s->functions;
+    total->edges += s->edges;
+    total->retained += s->retained;
+    total->dropped += s->dropped;
+    total->reused += s->reused;
+    total->tokens += s->tokens;
+    total->bytes += s->bytes;
+    total->failures += s->failures;
+}
+
+void stats_print(FILE *f, const char *name, const stats_t *s) {
+    static const char *phases[PHASE_COUNT] = {
+        [PHASE_PARSE] = "parse",
+        [PHASE_CFG] = "cfg",
+        [PHASE_REACH] = "reachability",
+        [PHASE_EMIT] = "emit",
+    };
+
+    stats_print_string(f, name);
+    fprintf(f, ":{\"phases\":{");
+    for (unsigned int i = 0; i < PHASE_COUNT; i++)
+        fprintf(f, "%s\"%s\":{\"wall\":%.6f,\"cpu\":%.6f}", i == 0 ? "" : ",",
+            phases[i], s->wall[i], s->cpu[i]);
+    unsigned long definitions = s->retained + s->dropped;
+    fprintf(f, "},\"functions\":%lu,\"call_edges\":%lu,\"retained\":%lu,"
+        "\"dropped\":%lu,\"retained_ratio\":%.4f,\"reused\":%lu,"
+        "\"tokens\":%lu,\"bytes\":%lu,\"failures\":%lu}",
+        s->functions, s->edges, s->retained, s->dropped,
+        definitions == 0 ? 0.0 : (double)s->retained / definitions, s->reused,
+        s->tokens, s->bytes, s->failures);
+}
+
+void stats_print_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s != '\0'; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+long stats_peak_rss(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return -1;
+    return usage.ru_maxrss;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+/* Timing and counters for the phases of pruning, so we can tell where time is
+ * spent.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+typedef enum {
+    PHASE_PARSE,    /* parsing (or loading) the translation unit */
+    PHASE_CFG,      /* building the CFG */
+    PHASE_REACH,    /* finding the functions reachable from those kept */
+    PHASE_EMIT,     /* writing output */
+    PHASE_COUNT,
+} phase_t;
+
+typedef struct {
+    double wall[PHASE_COUNT];   /* seconds */
+    double cpu[PHASE_COUNT];    /* seconds, of the thread running the phase */
+    unsigned long functions;    /* function definitions */
+    unsigned long edges;        /* call edges scanned */
+    unsigned long retained;     /* function definitions emitted */
+    unsigned long dropped;      /* function definitions pruned */
+    unsigned long reused;       /* declarations whose previous output was
+                                 * reused (see prune_t.incremental) */
+    unsigned long tokens;       /* tokens emitted */
+    unsigned long bytes;        /* bytes of output */
+    unsigned long failures;     /* input files that could not be pruned */
+} stats_t;
+
+typedef struct {
+    struct timespec wall;
+    struct timespec cpu;
+} stopwatch_t;
+
+/* Start timing a phase. */
+void stopwatch_start(stopwatch_t *w);
+
+/* Add the time since the stopwatch was started in this thread to the given
+ * phase.
+ */
+void stats_record(stats_t *s, phase_t phase, const stopwatch_t *w);
+
+/* Accumulate one set of statistics into another. */
+void stats_add(stats_t *total, const stats_t *s);
+
+/* Write statistics as a JSON object member, with the given name. */
+void stats_print(FILE *f, const char *name, const stats_t *s);
+
+/* Write a string as a JSON string literal. */
+void stats_print_string(FILE *f, const char *s);
+
+/* Peak resident set size of this process, in kilobytes. */
+long stats_peak_rss(void);
+
+#endif
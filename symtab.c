@@ -0,0 +1,109 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#include "arena.h"
+#include <assert.h>
+#include <glib.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "symtab.h"
+
+struct symtab {
+    pthread_mutex_t lock;   /* the table is shared by all threads */
+    GHashTable *ids;    /* string -> identifier + 1 */
+    const char **names; /* identifier -> string */
+    unsigned int names_sz;
+    unsigned int names_cap;
+    arena_t *strings;
+};
+
+symtab_t *symtab(void) {
+    symtab_t *t = calloc(1, sizeof(*t));
+    if (t == NULL)
+        return NULL;
+    t->strings = arena();
+    if (t->strings == NULL) {
+        free(t);
+        return NULL;
+    }
+    pthread_mutex_init(&t->lock, NULL);
+    t->ids = g_hash_table_new(g_str_hash, g_str_equal);
+    return t;
+}
+
+void symtab_destroy(symtab_t *t) {
+    g_hash_table_destroy(t->ids);
+    arena_destroy(t->strings);
+    free(t->names);
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+}
+
+/* Look up a string. The caller must hold the lock. */
+static bool lookup(symtab_t *t, const char *name, sym_t *sym) {
+    gpointer value = g_hash_table_lookup(t->ids, name);
+    if (value == NULL)
+        return false;
+    *sym = GPOINTER_TO_UINT(value) - 1;
+    return true;
+}
+
+sym_t symtab_intern(symtab_t *t, const char *name) {
+    sym_t sym = SYM_NONE;
+    pthread_mutex_lock(&t->lock);
+
+    if (lookup(t, name, &sym))
+        goto done;
+
+    if (t->names_sz == t->names_cap) {
+        unsigned int cap = t->names_cap == 0 ? 1024 : t->names_cap * 2;
+        const char **names = realloc(t->names, cap * sizeof(*names));
+        if (names == NULL)
+            goto done;
+        t->names = names;
+        t->names_cap = cap;
+    }
+
+    const char *copy = arena_copy(t->strings, name, strlen(name) + 1);
+    if (copy == NULL)
+        goto done;
+
+    sym = t->names_sz++;
+    t->names[sym] = copy;
+    g_hash_table_insert(t->ids, (gpointer)copy, GUINT_TO_POINTER(sym + 1));
+
+done:
+    pthread_mutex_unlock(&t->lock);
+    return sym;
+}
+
+bool symtab_lookup(symtab_t *t, const char *name, sym_t *sym) {
+    pthread_mutex_lock(&t->lock);
+    bool found = lookup(t, name, sym);
+    pthread_mutex_unlock(&t->lock);
+    return found;
+}
+
+const char *symtab_name(symtab_t *t, sym_t sym) {
+    pthread_mutex_lock(&t->lock);
+    assert(sym < t->names_sz);
+    const char *name = t->names[sym];
+    pthread_mutex_unlock(&t->lock);
+    return name;
+}
+
+unsigned int symtab_size(symtab_t *t) {
+    pthread_mutex_lock(&t->lock);
+    unsigned int size = t->names_sz;
+    pthread_mutex_unlock(&t->lock);
+    return size;
+}
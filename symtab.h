@@ -0,0 +1,52 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#ifndef _SYMTAB_H_
+#define _SYMTAB_H_
+
+/* Implementation of a symbol table (string interner). Each distinct string
+ * added to the table is copied once into an arena and assigned a dense integer
+ * identifier, so the rest of the program can compare and hash symbols as
+ * plain integers. A table may be safely shared between threads.
+ */
+
+#include <stdbool.h>
+
+typedef unsigned int sym_t;
+
+/* An identifier that is never assigned to any symbol. */
+#define SYM_NONE ((sym_t)-1)
+
+typedef struct symtab symtab_t;
+
+/* Returns NULL on failure. */
+symtab_t *symtab(void);
+void symtab_destroy(symtab_t *t);
+
+/* Retrieve the identifier of a string, adding it to the table if it has not
+ * been seen before. Returns SYM_NONE on failure.
+ */
+sym_t symtab_intern(symtab_t *t, const char *name);
+
+/* Retrieve the identifier of a string without adding it. Returns false if the
+ * string is not in the table.
+ */
+bool symtab_lookup(symtab_t *t, const char *name, sym_t *sym);
+
+/* Retrieve the string for a given identifier. The result remains valid until
+ * the table is destroyed.
+ */
+const char *symtab_name(symtab_t *t, sym_t sym);
+
+/* Number of identifiers assigned so far. All identifiers are less than this.
+ */
+unsigned int symtab_size(symtab_t *t);
+
+#endif
@@ -0,0 +1,82 @@
+#!/bin/sh
+#
+# Copyright 2014, NICTA
+#
+# This software may be distributed and modified according to the terms of
+# the BSD 2-Clause license. Note that NO WARRANTY is provided.
+# See "LICENSE_BSD2.txt" for details.
+#
+# @TAG(NICTA_BSD)
+#
+
+# Regression test for incremental emission in --serve mode. An input is pruned,
+# edited so that libclang's excess token after an unchanged declaration is
+# different, and pruned again. The second output must have each definition
+# exactly once, rather than reusing the stale output of the unchanged text
+# alongside the new declaration.
+#
+# Usage: incremental.sh [prune]
+
+set -e
+
+PRUNE=${1:-./prune}
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/prune-test.XXXXXX")
+trap 'kill ${PID} 2>/dev/null || true; rm -rf "${WORK}"' EXIT
+
+cat > "${WORK}/input.c" <<'END'
+int x = 1;
+struct foo { int a; };
+int main(void) { return 0; }
+END
+
+mkfifo "${WORK}/requests"
+${PRUNE} --verbatim --serve "${WORK}/input.c" < "${WORK}/requests" \
+    > "${WORK}/responses" &
+PID=$!
+exec 3> "${WORK}/requests"
+
+# Wait until the given number of prune responses have arrived.
+wait_for() {
+    TRIES=0
+    while [ "$(grep -c '^ok [0-9]*$' "${WORK}/responses" || true)" -lt "$1" ]; do
+        TRIES=$((TRIES + 1))
+        if [ ${TRIES} -gt 100 ]; then
+            echo " [TEST] incremental: no response from prune" >&2
+            exit 1
+        fi
+        sleep 0.1
+    done
+}
+
+printf 'keep main\nprune\n' >&3
+wait_for 1
+
+cat > "${WORK}/input.c" <<'END'
+int x = 1, y = 2;
+typedef struct foo { int a; } foo_t;
+int main(void) { return 0; }
+END
+
+printf 'keep main\nprune\nquit\n' >&3
+exec 3>&-
+wait ${PID}
+
+# The output of the second prune.
+awk '/^ok [0-9]+$/ { n++; next } /^ok$/ { next } n == 2 { print }' \
+    "${WORK}/responses" > "${WORK}/output.c"
+
+check() {
+    COUNT=$(grep -c "$1" "${WORK}/output.c" || true)
+    if [ "${COUNT}" -ne "$2" ]; then
+        echo " [TEST] incremental: expected $2 of '$1', found ${COUNT}:" >&2
+        cat "${WORK}/output.c" >&2
+        exit 1
+    fi
+}
+check '^int x = 1, y = 2;$' 1
+check '^int x = 1;$' 0
+check 'struct foo {' 1
+check '} foo_t;$' 1
+
+echo " [TEST] incremental: ok"